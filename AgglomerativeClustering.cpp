@@ -1,10 +1,14 @@
 #include "ns.hpp"
+#include "Checkpoint.hpp"
 #include "Dataset.hpp"
+#include "Dendrogram.hpp"
+#include "Exec.hpp"
 
 #include <vector>
 #include <limits>
 #include <iostream>
 #include <algorithm>
+#include <memory>
 
 long double cluster::agg::lSingle(
   cluster::dist::DistanceMeasure dist,
@@ -15,10 +19,15 @@ long double cluster::agg::lSingle(
   long double minDist = std::numeric_limits<long double>::max();
   cluster::Dataset::index_t n1 = cluster1.nObs();
   cluster::Dataset::index_t n2 = cluster2.nObs();
+  // Rows of views with their own columns are gathered into these, which are
+  // kept from call to call (on each thread) so merging doesn't allocate.
+  thread_local std::vector<cluster::data_t> scratch1, scratch2;
 
   for (cluster::Dataset::index_t i = 0; i < n1; i++) {
+    auto x = cluster1.row(i, scratch1);
+
     for (cluster::Dataset::index_t j = 0; j < n2; j++) {
-      minDist = std::min(minDist, dist(cluster1[i], cluster2[j]));
+      minDist = std::min(minDist, dist(x, cluster2.row(j, scratch2)));
     }
   }
 
@@ -34,10 +43,13 @@ long double cluster::agg::lComplete(
   long double maxDist = std::numeric_limits<long double>::lowest();
   cluster::Dataset::index_t n1 = cluster1.nObs();
   cluster::Dataset::index_t n2 = cluster2.nObs();
+  thread_local std::vector<cluster::data_t> scratch1, scratch2;
 
   for (cluster::Dataset::index_t i = 0; i < n1; i++) {
+    auto x = cluster1.row(i, scratch1);
+
     for (cluster::Dataset::index_t j = 0; j < n2; j++) {
-      maxDist = std::max(maxDist, dist(cluster1[i], cluster2[j]));
+      maxDist = std::max(maxDist, dist(x, cluster2.row(j, scratch2)));
     }
   }
 
@@ -49,18 +61,50 @@ long double cluster::agg::lAverage(
   const cluster::Dataset& cluster1,
   const cluster::Dataset& cluster2
 ) {
-  // Find the closest two items between the clusters.
+  // Average the distances between the clusters' items, counting each item
+  // as many times as it's weighted.
   long double sum = 0;
   cluster::Dataset::index_t n1 = cluster1.nObs();
   cluster::Dataset::index_t n2 = cluster2.nObs();
+  thread_local std::vector<cluster::data_t> scratch1, scratch2;
 
   for (cluster::Dataset::index_t i = 0; i < n1; i++) {
+    long double w1 = cluster1.weight(i);
+    auto x = cluster1.row(i, scratch1);
+
     for (cluster::Dataset::index_t j = 0; j < n2; j++) {
-      sum += dist(cluster1[i], cluster2[j]);
+      sum += w1 * cluster2.weight(j) * dist(x, cluster2.row(j, scratch2));
     }
   }
 
-  return sum / (n1 * n2);
+  return sum / (cluster1.totalWeight() * cluster2.totalWeight());
+}
+
+// The (weighted) mean of each variable in a cluster, written into out. Each
+// column is summed in row order, just as stat::mean does.
+static void centroid(
+  const cluster::Dataset& cluster,
+  std::vector<long double>& out
+) {
+  bool weighted = cluster.weighted();
+  long double total = 0;
+  thread_local std::vector<cluster::data_t> scratch;
+  out.assign(cluster.nVars(), 0);
+
+  for (cluster::Dataset::index_t i = 0; i < cluster.nObs(); i++) {
+    auto row = cluster.row(i, scratch);
+    long double w = weighted ? cluster.weight(i) : 1;
+
+    for (cluster::Dataset::index_t j = 0; j < cluster.nVars(); j++) {
+      out[j] += weighted ? w * row[j] : row[j];
+    }
+
+    total += w;
+  }
+
+  for (auto& m : out) {
+    m /= total;
+  }
 }
 
 long double cluster::agg::lCentroid(
@@ -68,87 +112,490 @@ long double cluster::agg::lCentroid(
   const cluster::Dataset& cluster1,
   const cluster::Dataset& cluster2
 ) {
-  return dist(
-    cluster1.applyCol(cluster::stat::mean),
-    cluster2.applyCol(cluster::stat::mean)
-  );
+  // Reused from call to call (on each thread) so merging doesn't allocate.
+  thread_local std::vector<long double> m1, m2;
+  centroid(cluster1, m1);
+  centroid(cluster2, m2);
+  return dist(m1, m2);
 }
 
-template <class T>
-static std::vector<T> difference(std::vector<T> x, std::vector<T> y) {
-  std::vector<T> diff;
+long double cluster::agg::lWards(
+  cluster::dist::DistanceMeasure dist,
+  const cluster::Dataset& cluster1,
+  const cluster::Dataset& cluster2
+) {
+  thread_local std::vector<long double> m1, m2;
+  auto n1 = cluster1.totalWeight();
+  auto n2 = cluster2.totalWeight();
+  long double sumOfSquares = 0;
+  centroid(cluster1, m1);
+  centroid(cluster2, m2);
 
-  for (int i = 0; i < x.size(); i++) {
-    diff.push_back(x[i] - y[i]);
+  for (std::size_t j = 0; j < m1.size(); j++) {
+    long double diff = m1[j] - m2[j];
+    sumOfSquares += diff * diff;
   }
 
-  return diff;
+  return n1 * n2 / (n1 + n2) * sumOfSquares;
 }
 
-static long double sumOfSquares(std::vector<long double> x) {
-  long double sum = 0;
+// The nearest earlier cluster of every active cluster. Row k only looks at
+// clusters j < k, and ties go to the smallest j, so the scan below finds the
+// same pair as checking every i > j in order would.
+struct NearestCache {
+  std::vector<int> nn;
+  std::vector<long double> nnDist;
+  // Each worker's best row in closestRow().
+  std::vector<int> best;
+};
 
-  for (auto v : x) {
-    sum += v * v;
+static void findNearest(
+  const std::vector<cluster::Dataset>& clusters,
+  cluster::dist::DistanceMeasure dist,
+  cluster::agg::Linkage linkage,
+  NearestCache& cache,
+  int k
+) {
+  cache.nn[k] = -1;
+  cache.nnDist[k] = std::numeric_limits<long double>::max();
+
+  for (int j = 0; j < k; j++) {
+    long double d = linkage(dist, clusters[k], clusters[j]);
+
+    if (d < cache.nnDist[k]) {
+      cache.nnDist[k] = d;
+      cache.nn[k] = j;
+    }
+  }
+}
+
+static int closestRow(NearestCache& cache, cluster::exec::Policy policy) {
+  std::vector<int>& best = cache.best;
+  best.assign(
+    policy == cluster::exec::Policy::threads ? cluster::exec::concurrency() : 1,
+    -1
+  );
+
+  cluster::exec::parallelFor(
+    cache.nn.size(),
+    policy,
+    [&](std::size_t begin, std::size_t end, unsigned int worker) {
+      int& b = best[worker];
+
+      for (int k = begin; k < (int)end; k++) {
+        if (
+          cache.nn[k] >= 0 &&
+          (b < 0 || cache.nnDist[k] < cache.nnDist[b] ||
+            (cache.nnDist[k] == cache.nnDist[b] && k < b))
+        ) {
+          b = k;
+        }
+      }
+    }
+  );
+
+  int c = -1;
+
+  for (int b : best) {
+    if (
+      b >= 0 &&
+      (c < 0 || cache.nnDist[b] < cache.nnDist[c] ||
+        (cache.nnDist[b] == cache.nnDist[c] && b < c))
+    ) {
+      c = b;
+    }
   }
 
-  return sum;
+  return c;
 }
 
-long double cluster::agg::lWards(
-  cluster::dist::DistanceMeasure dist,
-  const cluster::Dataset& cluster1,
-  const cluster::Dataset& cluster2
+// The rows of every active cluster, packed into buffers allocated once per
+// run and handed to the clusters' views without copying. A merge writes the
+// two lists end to end into the free space at the back of the current
+// buffer; when that runs out, the live lists are packed into the spare
+// buffer, which takes over. Live lists never hold more than n rows between
+// them, so with room for 2n there's always space after packing.
+class RowArena {
+private:
+  std::shared_ptr<std::vector<cluster::index_t>> current;
+  std::shared_ptr<std::vector<cluster::index_t>> spare;
+  std::size_t used;
+  std::vector<std::size_t> starts;
+  std::vector<cluster::index_t> sizes;
+
+  void pack() {
+    std::size_t at = 0;
+
+    for (std::size_t k = 0; k < this->starts.size(); k++) {
+      std::copy_n(
+        this->current->begin() + this->starts[k],
+        this->sizes[k],
+        this->spare->begin() + at
+      );
+      this->starts[k] = at;
+      at += this->sizes[k];
+    }
+
+    std::swap(this->current, this->spare);
+    this->used = at;
+  }
+
+public:
+  // lists hold indices into the data, which rows translates into indices
+  // into the storage the clusters view.
+  RowArena(
+    const std::vector<std::vector<cluster::index_t>>& lists,
+    const std::vector<cluster::index_t>& rows
+  ) : used(0) {
+    std::size_t n = 0;
+
+    for (auto& list : lists) {
+      n += list.size();
+    }
+
+    this->current = std::make_shared<std::vector<cluster::index_t>>(2 * n);
+    this->spare = std::make_shared<std::vector<cluster::index_t>>(2 * n);
+
+    for (auto& list : lists) {
+      for (std::size_t i = 0; i < list.size(); i++) {
+        (*this->current)[this->used + i] = rows[list[i]];
+      }
+
+      this->starts.push_back(this->used);
+      this->sizes.push_back(list.size());
+      this->used += list.size();
+    }
+  }
+
+  // A view of the stored rows in cluster k. It stays valid until the next
+  // merge.
+  cluster::Dataset view(const cluster::Dataset& data, std::size_t k) const {
+    return data.rows(
+      this->current->data() + this->starts[k],
+      this->sizes[k],
+      std::shared_ptr<const void>(this->current, this->current->data())
+    );
+  }
+
+  // Append cluster c2's rows to c1's and drop c2. Returns whether the
+  // buffers were repacked, moving every cluster's rows.
+  bool merge(std::size_t c1, std::size_t c2) {
+    bool packed = false;
+    std::size_t size = (std::size_t)this->sizes[c1] + this->sizes[c2];
+
+    if (this->used + size > this->current->size()) {
+      this->pack();
+      packed = true;
+    }
+
+    auto rows = this->current->begin();
+    std::copy_n(rows + this->starts[c1], this->sizes[c1], rows + this->used);
+    std::copy_n(
+      rows + this->starts[c2],
+      this->sizes[c2],
+      rows + this->used + this->sizes[c1]
+    );
+    this->starts[c1] = this->used;
+    this->sizes[c1] = size;
+    this->used += size;
+
+    this->starts.erase(this->starts.begin() + c2);
+    this->sizes.erase(this->sizes.begin() + c2);
+    return packed;
+  }
+};
+
+// Whether stop would have ended a run before it made all of merges. They're
+// replayed from single rows, asking stop before each one just as the merge
+// loop does, and should leave the clusters with the given ids.
+static bool stopsBefore(
+  const cluster::Dataset& base,
+  const std::vector<cluster::index_t>& stored,
+  const std::vector<cluster::agg::Dendrogram::Merge>& merges,
+  const std::vector<cluster::index_t>& finalIds,
+  cluster::agg::StopCriteria stop,
+  const std::string& file
 ) {
-  auto n1 = cluster1.nObs();
-  auto n2 = cluster2.nObs();
-  auto m1 = cluster1.applyCol(cluster::stat::mean);
-  auto m2 = cluster2.applyCol(cluster::stat::mean);
+  cluster::index_t n = stored.size();
+  std::vector<std::vector<cluster::index_t>> singles(n);
+  std::vector<cluster::index_t> ids(n);
+
+  for (cluster::index_t i = 0; i < n; i++) {
+    singles[i] = {i};
+    ids[i] = i;
+  }
+
+  RowArena arena(singles, stored);
+  std::vector<cluster::Dataset> clusters;
+
+  for (std::size_t k = 0; k < ids.size(); k++) {
+    clusters.push_back(arena.view(base, k));
+  }
+
+  for (std::size_t t = 0; t < merges.size(); t++) {
+    if (stop(clusters)) {
+      return true;
+    }
+
+    // The later cluster is merged into, as in the merge loop.
+    std::size_t c1 =
+      std::find(ids.begin(), ids.end(), merges[t].left) - ids.begin();
+    std::size_t c2 =
+      std::find(ids.begin(), ids.end(), merges[t].right) - ids.begin();
+
+    if (c1 == ids.size() || c2 >= c1) {
+      throw "Checkpoint is corrupt: " + file;
+    }
+
+    if (arena.merge(c1, c2)) {
+      for (std::size_t k = 0; k < clusters.size() - 1; k++) {
+        clusters[k < c2 ? k : k + 1] = arena.view(base, k);
+      }
+    }
+
+    clusters.erase(clusters.begin() + c2);
+    clusters[c1 - 1] = arena.view(base, c1 - 1);
+    ids[c1] = n + t;
+    ids.erase(ids.begin() + c2);
+  }
 
-  return (double)n1 * n2 / (n1 + n2) * sumOfSquares(difference(m1, m2));
+  if (ids != finalIds) {
+    throw "Checkpoint is corrupt: " + file;
+  }
+
+  return false;
 }
 
-std::vector<cluster::Dataset> cluster::agg::agglomerativeClustering(
+// Merges clusters until stop() is satisfied, recording each merge in history
+// when one is given, and snapshotting to (and resuming from) checkpoint when
+// one is given. Apart from snapshots, and the threads Policy::threads starts,
+// the merge loop doesn't allocate: clusters are views into a RowArena and
+// all other scratch space is sized up front.
+static std::vector<cluster::Dataset> mergeClusters(
   const cluster::Dataset& data,
   cluster::dist::DistanceMeasure dist,
   cluster::agg::Linkage linkage,
-  cluster::agg::StopCriteria stop
+  cluster::agg::StopCriteria stop,
+  cluster::exec::Policy policy,
+  cluster::agg::Dendrogram* history,
+  cluster::agg::Checkpoint* checkpoint
 ) {
+  // Clusters view the storage under data directly, so a view's rows are
+  // looked up once here rather than composed with on every merge, and
+  // nothing is copied.
+  std::vector<cluster::index_t> stored;
+  const cluster::Dataset base = data.storedRows(&stored);
   std::vector<cluster::Dataset> clusters;
+  std::vector<cluster::index_t> ids;
+  NearestCache cache;
+  // The rows in each cluster, only kept track of for snapshots.
+  std::vector<std::vector<cluster::index_t>> members;
+  cluster::agg::Checkpoint::State resumed;
+  bool resuming = checkpoint && checkpoint->resume(data, dist, linkage, resumed);
+  // Snapshots always carry the merges so far, so flat runs keep a tree too.
+  cluster::agg::Dendrogram merges(data.nObs());
+
+  if (checkpoint && !history) {
+    history = &merges;
+  }
+
+  if (resuming) {
+    if (resumed.merges.size() != data.nObs() - resumed.members.size()) {
+      throw "Checkpoint has no merge history: " + checkpoint->file();
+    }
+
+    // The snapshot may come from a run that went on past this one's stop;
+    // merges can't be undone, so that run can't be carried on from it.
+    if (
+      stopsBefore(base, stored, resumed.merges, resumed.ids, stop,
+        checkpoint->file())
+    ) {
+      throw "Checkpoint has merged past this run's stop criterion: " +
+        checkpoint->file();
+    }
+
+    if (history) {
+      for (auto& merge : resumed.merges) {
+        history->merge(merge.left, merge.right, merge.height);
+      }
+    }
+
+    members = std::move(resumed.members);
+    ids = std::move(resumed.ids);
+    cache.nn = std::move(resumed.nn);
+    cache.nnDist = std::move(resumed.nnDist);
+  } else {
+    // Initially, put each observation in its own cluster.
+    for (cluster::Dataset::index_t i = 0; i < data.nObs(); i++) {
+      members.push_back({i});
+      ids.push_back(i);
+    }
+  }
+
+  RowArena arena(members, stored);
 
-  // Initially, put each observation in its own cluster.
-  for (cluster::Dataset::index_t i = 0; i < data.nObs(); i++) {
-    clusters.push_back(
-      data[std::vector<cluster::Dataset::index_t>({i})]
+  if (!checkpoint) {
+    members.clear();
+  }
+
+  clusters.reserve(ids.size());
+
+  for (std::size_t k = 0; k < ids.size(); k++) {
+    clusters.push_back(arena.view(base, k));
+  }
+
+  if (!resuming) {
+    // Find every cluster's nearest neighbour once up front.
+    cache.nn.resize(clusters.size());
+    cache.nnDist.resize(clusters.size());
+
+    cluster::exec::parallelFor(
+      clusters.size(),
+      policy,
+      [&](std::size_t begin, std::size_t end, unsigned int) {
+        for (std::size_t k = begin; k < end; k++) {
+          findNearest(clusters, dist, linkage, cache, k);
+        }
+      }
     );
   }
 
+  std::vector<char> stale(clusters.size());
+
   // While the stop criterion isn't satisfied...
   while (!stop(clusters) && clusters.size() > 1) {
     // Determine which two clusters are closest.
-    int c1 = -1, c2 = -1;
-    long double minDist = std::numeric_limits<long double>::max();
-
-    for (int i = 1; i < clusters.size(); i++) {
-      for (int j = 0; j < i; j++) {
-        cluster::data_t d = linkage(dist, clusters[i], clusters[j]);
-
-        if (d < minDist) {
-          // std::cout << "New min dist" << std::endl;
-          minDist = d;
-          c1 = i;
-          c2 = j;
-        } else if (d == minDist) {
-          // std::cout << "Duplicate min dist" << std::endl;
-        }
+    int c1 = closestRow(cache, policy);
+    int c2 = cache.nn[c1];
+    long double height = cache.nnDist[c1];
+
+    // Merge those two clusters.
+    if (arena.merge(c1, c2)) {
+      for (std::size_t k = 0; k < clusters.size() - 1; k++) {
+        clusters[k < (std::size_t)c2 ? k : k + 1] = arena.view(base, k);
       }
     }
 
-    // Merge those two clusters.
-    cluster::Dataset merged = clusters[c1] + clusters[c2];
-    clusters[c1] = merged;
     clusters.erase(clusters.begin() + c2);
+    clusters[c1 - 1] = arena.view(base, c1 - 1);
+
+    if (history) {
+      ids[c1] = history->merge(ids[c1], ids[c2], height);
+    }
+
+    ids.erase(ids.begin() + c2);
+
+    if (checkpoint) {
+      members[c1].insert(
+        members[c1].end(), members[c2].begin(), members[c2].end()
+      );
+      members.erase(members.begin() + c2);
+    }
+
+    // Only rows whose nearest neighbour was merged away need a full rescan;
+    // every other row just compares its cached minimum against the new
+    // cluster, which now sits at c1 - 1.
+
+    for (int k = 0; k < (int)clusters.size(); k++) {
+      int old = k < c2 ? k : k + 1;
+      int nn = cache.nn[old];
+      stale[k] = nn == c1 || nn == c2;
+      cache.nn[k] = nn > c2 ? nn - 1 : nn;
+      cache.nnDist[k] = cache.nnDist[old];
+    }
+
+    cache.nn.pop_back();
+    cache.nnDist.pop_back();
+
+    int mergedAt = c1 - 1;
+    stale[mergedAt] = true;
+
+    cluster::exec::parallelFor(
+      clusters.size(),
+      policy,
+      [&](std::size_t begin, std::size_t end, unsigned int) {
+        for (int k = begin; k < (int)end; k++) {
+          if (stale[k]) {
+            findNearest(clusters, dist, linkage, cache, k);
+          } else if (k > mergedAt) {
+            long double d = linkage(dist, clusters[k], clusters[mergedAt]);
+
+            if (
+              d < cache.nnDist[k] ||
+              (d == cache.nnDist[k] && mergedAt < cache.nn[k])
+            ) {
+              cache.nnDist[k] = d;
+              cache.nn[k] = mergedAt;
+            }
+          }
+        }
+      }
+    );
+
+    if (checkpoint && checkpoint->due(clusters.size())) {
+      checkpoint->save({
+        members,
+        ids,
+        cache.nn,
+        cache.nnDist,
+        history ? history->steps()
+          : std::vector<cluster::agg::Dendrogram::Merge>()
+      });
+    }
+  }
+
+  // Only interrupted runs should be picked up again.
+  if (checkpoint) {
+    checkpoint->complete();
   }
 
   return clusters;
 }
+
+std::vector<cluster::Dataset> cluster::agg::agglomerativeClustering(
+  const cluster::Dataset& data,
+  cluster::dist::DistanceMeasure dist,
+  cluster::agg::Linkage linkage,
+  cluster::agg::StopCriteria stop,
+  cluster::exec::Policy policy
+) {
+  return mergeClusters(data, dist, linkage, stop, policy, nullptr, nullptr);
+}
+
+std::vector<cluster::Dataset> cluster::agg::agglomerativeClustering(
+  const cluster::Dataset& data,
+  cluster::dist::DistanceMeasure dist,
+  cluster::agg::Linkage linkage,
+  cluster::agg::StopCriteria stop,
+  cluster::agg::Checkpoint& checkpoint,
+  cluster::exec::Policy policy
+) {
+  return mergeClusters(data, dist, linkage, stop, policy, nullptr, &checkpoint);
+}
+
+static bool neverStop(const std::vector<cluster::Dataset>& clusters) {
+  return false;
+}
+
+cluster::agg::Dendrogram cluster::agg::hierarchy(
+  const cluster::Dataset& data,
+  cluster::dist::DistanceMeasure dist,
+  cluster::agg::Linkage linkage,
+  cluster::exec::Policy policy
+) {
+  cluster::agg::Dendrogram tree(data.nObs());
+  mergeClusters(data, dist, linkage, neverStop, policy, &tree, nullptr);
+  return tree;
+}
+
+cluster::agg::Dendrogram cluster::agg::hierarchy(
+  const cluster::Dataset& data,
+  cluster::dist::DistanceMeasure dist,
+  cluster::agg::Linkage linkage,
+  cluster::agg::Checkpoint& checkpoint,
+  cluster::exec::Policy policy
+) {
+  cluster::agg::Dendrogram tree(data.nObs());
+  mergeClusters(data, dist, linkage, neverStop, policy, &tree, &checkpoint);
+  return tree;
+}
@@ -0,0 +1,41 @@
+#include "ns.hpp"
+
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+static std::atomic<std::size_t> allocations(0);
+
+bool cluster::alloc::counting() {
+#ifdef COUNT_ALLOCATIONS
+  return true;
+#else
+  return false;
+#endif
+}
+
+std::size_t cluster::alloc::count() {
+  return allocations.load(std::memory_order_relaxed);
+}
+
+#ifdef COUNT_ALLOCATIONS
+// Replace the global allocation functions with ones that count calls. The
+// array and nothrow forms all end up here.
+void* operator new(std::size_t size) {
+  allocations.fetch_add(1, std::memory_order_relaxed);
+
+  if (void* p = std::malloc(size > 0 ? size : 1)) {
+    return p;
+  }
+
+  throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept {
+  std::free(p);
+}
+
+void operator delete(void* p, std::size_t) noexcept {
+  std::free(p);
+}
+#endif
@@ -0,0 +1,174 @@
+#include "ns.hpp"
+#include "Batch.hpp"
+#include "Dataset.hpp"
+#include "Dendrogram.hpp"
+#include "DistanceMatrix.hpp"
+#include "Exec.hpp"
+
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+std::vector<cluster::agg::BatchResult> cluster::agg::batch(
+  const cluster::Dataset& data,
+  const std::vector<cluster::dist::DistanceMeasure*>& metrics,
+  const std::vector<cluster::agg::Linkage*>& linkages,
+  const std::vector<cluster::index_t>& ks,
+  cluster::exec::Policy policy,
+  std::size_t maxCopies
+) {
+  std::vector<cluster::agg::BatchResult> results;
+
+  for (auto metric : metrics) {
+    for (auto linkage : linkages) {
+      results.push_back({metric, linkage, {}, {}});
+    }
+  }
+
+  // lWards ignores the metric and only has a Lance-Williams form for
+  // euclidean distances, so its tree is built once, from euclidean
+  // distances, and shared by every metric.
+  std::unique_ptr<cluster::agg::Dendrogram> wards;
+  bool wantsWards = false;
+
+  for (auto linkage : linkages) {
+    wantsWards = wantsWards || linkage == cluster::agg::lWards;
+  }
+
+  // Weighted rows count for their weight in the updates, as they do in the
+  // linkages.
+  std::vector<cluster::data_t> weights = data.weights();
+
+  for (std::size_t m = 0; m < metrics.size(); m++) {
+    bool isEuclidean = metrics[m] == cluster::dist::euclidean;
+    cluster::DistanceMatrix distances = cluster::dist::pairwise(
+      data, metrics[m], policy
+    );
+    std::unique_ptr<cluster::DistanceMatrix> euclidean;
+
+    if (!isEuclidean && wantsWards && !wards) {
+      euclidean.reset(new cluster::DistanceMatrix(
+        cluster::dist::pairwise(data, cluster::dist::euclidean, policy)
+      ));
+    }
+
+    // Which matrix, if any, each linkage merges. Centroids under other
+    // metrics, and custom linkages, need the data itself.
+    std::vector<cluster::DistanceMatrix*> sources(linkages.size(), nullptr);
+    std::size_t sharing = 0;
+
+    for (std::size_t l = 0; l < linkages.size(); l++) {
+      auto linkage = linkages[l];
+
+      if (linkage == cluster::agg::lWards && !wards) {
+        sources[l] = isEuclidean ? &distances : euclidean.get();
+      } else if (
+        linkage == cluster::agg::lSingle ||
+        linkage == cluster::agg::lComplete ||
+        linkage == cluster::agg::lAverage ||
+        (linkage == cluster::agg::lCentroid && isEuclidean)
+      ) {
+        sources[l] = &distances;
+      }
+
+      sharing += sources[l] == &distances;
+    }
+
+    // Merging overwrites the matrix, so every linkage but the last to get to
+    // it works on a copy, and the last takes the original. Linkages wanting
+    // a copy while maxCopies are out wait for one to be given back.
+    std::mutex handing;
+    std::condition_variable givenBack;
+    std::size_t copies = 0;
+    std::size_t mostCopies =
+      maxCopies > 0 ? maxCopies : cluster::exec::concurrency();
+
+    auto take = [&](cluster::DistanceMatrix* source, bool& copied) {
+      copied = false;
+
+      if (source != &distances) {
+        return std::move(*source);
+      }
+
+      std::unique_lock<std::mutex> lock(handing);
+      givenBack.wait(lock, [&]() {
+        return sharing == 1 || copies < mostCopies;
+      });
+
+      if (--sharing == 0) {
+        return std::move(distances);
+      }
+
+      copies++;
+      copied = true;
+      return cluster::DistanceMatrix(distances);
+    };
+
+    auto giveBack = [&]() {
+      std::lock_guard<std::mutex> lock(handing);
+      copies--;
+      givenBack.notify_all();
+    };
+
+    // Run this metric's linkages side by side, each single-threaded.
+    cluster::exec::parallelFor(
+      linkages.size(),
+      policy,
+      [&](std::size_t begin, std::size_t end, unsigned int) {
+        for (std::size_t l = begin; l < end; l++) {
+          auto linkage = linkages[l];
+          auto& result = results[m * linkages.size() + l];
+
+          if (linkage == cluster::agg::lWards && wards) {
+            continue;
+          } else if (sources[l]) {
+            bool copied = false;
+
+            try {
+              result.tree = cluster::agg::lanceWilliams(
+                take(sources[l], copied),
+                weights,
+                linkage,
+                cluster::exec::Policy::serial
+              );
+            } catch (...) {
+              if (copied) giveBack();
+              throw;
+            }
+
+            if (copied) {
+              giveBack();
+            }
+          } else {
+            result.tree = cluster::agg::hierarchy(
+              data, metrics[m], linkage, cluster::exec::Policy::serial
+            );
+          }
+        }
+      },
+      1
+    );
+
+    for (std::size_t l = 0; l < linkages.size(); l++) {
+      if (linkages[l] != cluster::agg::lWards) continue;
+
+      auto& result = results[m * linkages.size() + l];
+
+      if (wards) {
+        result.tree = *wards;
+      } else {
+        wards.reset(new cluster::agg::Dendrogram(result.tree));
+      }
+    }
+  }
+
+  for (auto& result : results) {
+    for (auto k : ks) {
+      result.labels.push_back(result.tree.cut(k));
+    }
+  }
+
+  return results;
+}
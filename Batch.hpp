@@ -0,0 +1,18 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include "ns.hpp"
+#include "Dendrogram.hpp"
+
+#include <vector>
+
+// One cell of a batch of clusterings.
+struct cluster::agg::BatchResult {
+  cluster::dist::DistanceMeasure* dist;
+  cluster::agg::Linkage* linkage;
+  cluster::agg::Dendrogram tree;
+  // Labels for each k asked for, in the same order.
+  std::vector<std::vector<cluster::index_t>> labels;
+};
+
+#endif
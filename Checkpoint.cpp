@@ -0,0 +1,372 @@
+#include "ns.hpp"
+#include "Checkpoint.hpp"
+#include "Dataset.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <limits>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+// A snapshot is a header followed by the state. Every field is written
+// field by field with a fixed width (32 bits for indices, 64 for counts),
+// except for data_t values, which are written as they are in memory:
+//
+//   header:  magic, version, byte order mark, data_t's mantissa digits and
+//            size, dataset fingerprint, nObs, length and text of the run
+//   state:   number of active clusters, then each cluster's id, nearest
+//            neighbour, distance to it, member count and members, then the
+//            number of merges and each merge's left, right, height and size
+//
+// The byte order mark and data_t's layout are checked on reading, so a
+// snapshot moved to an incompatible platform is refused rather than misread.
+//
+// It's written to a temporary file that is synced and then renamed over the
+// last snapshot, so an interruption part way through leaves the last one
+// intact.
+namespace {
+  const char magic[4] = {'C', 'K', 'P', 'T'};
+  const std::uint32_t version = 2;
+  const std::uint32_t byteOrder = 0x01020304;
+}
+
+template <class T>
+static void pack(std::vector<char>& bytes, const T& value) {
+  const char* begin = reinterpret_cast<const char*>(&value);
+  bytes.insert(bytes.end(), begin, begin + sizeof(T));
+}
+
+template <class T>
+static T unpack(const std::vector<char>& bytes, std::size_t& at) {
+  if (at + sizeof(T) > bytes.size()) {
+    throw std::string("Checkpoint is truncated");
+  }
+
+  T value;
+  std::memcpy(&value, bytes.data() + at, sizeof(T));
+  at += sizeof(T);
+  return value;
+}
+
+// FNV-1a over the shape, values and weights of a dataset. Values are hashed
+// as doubles, since long doubles carry padding bytes with no fixed contents.
+static std::uint64_t fingerprintOf(const cluster::Dataset& data) {
+  std::uint64_t hash = 14695981039346656037ull;
+
+  auto mix = [&](std::uint64_t word) {
+    for (int b = 0; b < 8; b++) {
+      hash = (hash ^ ((word >> (8 * b)) & 0xff)) * 1099511628211ull;
+    }
+  };
+
+  auto mixValue = [&](cluster::data_t value) {
+    double d = value;
+    std::uint64_t word;
+    std::memcpy(&word, &d, sizeof(word));
+    mix(word);
+  };
+
+  mix(data.nObs());
+  mix(data.nVars());
+
+  for (cluster::index_t i = 0; i < data.nObs(); i++) {
+    for (auto value : data[i]) {
+      mixValue(value);
+    }
+
+    mixValue(data.weight(i));
+  }
+
+  return hash;
+}
+
+// What a run is told apart by besides its data: the distance, linkage and
+// caller's key.
+static std::string runOf(
+  cluster::dist::DistanceMeasure dist,
+  cluster::agg::Linkage linkage,
+  const std::string& key
+) {
+  std::string distName = cluster::dist::nameOf(dist);
+  std::string linkageName =
+    linkage == cluster::agg::lSingle ? "single" :
+    linkage == cluster::agg::lComplete ? "complete" :
+    linkage == cluster::agg::lAverage ? "average" :
+    linkage == cluster::agg::lCentroid ? "centroid" :
+    linkage == cluster::agg::lWards ? "ward" : "";
+
+  return (distName.empty() ? "custom" : distName) + " " +
+    (linkageName.empty() ? "custom" : linkageName) + " " + key;
+}
+
+static void writeFile(const std::string& path, const std::vector<char>& bytes) {
+  std::string temporary = path + ".tmp";
+  int fd = open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+  if (fd < 0) {
+    throw "Can't write checkpoint " + temporary + ": " + std::strerror(errno);
+  }
+
+  const char* at = bytes.data();
+  std::size_t left = bytes.size();
+
+  while (left > 0) {
+    ssize_t written = write(fd, at, left);
+
+    if (written < 0) {
+      if (errno == EINTR) continue;
+      std::string error = std::strerror(errno);
+      close(fd);
+      throw "Can't write checkpoint " + temporary + ": " + error;
+    }
+
+    at += written;
+    left -= written;
+  }
+
+  if (fsync(fd) != 0 || close(fd) != 0) {
+    throw "Can't write checkpoint " + temporary + ": " + std::strerror(errno);
+  }
+
+  if (std::rename(temporary.c_str(), path.c_str()) != 0) {
+    throw "Can't write checkpoint " + path + ": " + std::strerror(errno);
+  }
+}
+
+cluster::agg::Checkpoint::Checkpoint(
+  std::string path,
+  cluster::agg::Checkpoint::index_t every,
+  std::string key
+) : path(path), every(std::max<index_t>(every, 1)), key(key), fingerprint(0),
+    nObs(0), lastSaved(0) {}
+
+cluster::agg::Checkpoint::~Checkpoint() {
+  // Don't throw from here; call finish() to hear about a failed write.
+  if (pending.valid()) {
+    pending.wait();
+  }
+}
+
+const std::string& cluster::agg::Checkpoint::file() const {
+  return path;
+}
+
+cluster::agg::Checkpoint::index_t cluster::agg::Checkpoint::interval() const {
+  return every;
+}
+
+bool cluster::agg::Checkpoint::resume(
+  const cluster::Dataset& data,
+  cluster::dist::DistanceMeasure dist,
+  cluster::agg::Linkage linkage,
+  cluster::agg::Checkpoint::State& state
+) {
+  finish();
+
+  fingerprint = fingerprintOf(data);
+  run = runOf(dist, linkage, key);
+  nObs = data.nObs();
+  lastSaved = 0;
+
+  std::ifstream in(path, std::ios::binary);
+
+  if (!in) {
+    return false;
+  }
+
+  std::vector<char> bytes(
+    (std::istreambuf_iterator<char>(in)),
+    std::istreambuf_iterator<char>()
+  );
+  std::size_t at = 0;
+
+  for (char c : magic) {
+    if (unpack<char>(bytes, at) != c) {
+      throw "Not a checkpoint: " + path;
+    }
+  }
+
+  if (unpack<std::uint32_t>(bytes, at) != version) {
+    throw "Unsupported checkpoint version: " + path;
+  }
+
+  if (
+    unpack<std::uint32_t>(bytes, at) != byteOrder ||
+    unpack<std::uint32_t>(bytes, at) != std::numeric_limits<data_t>::digits ||
+    unpack<std::uint32_t>(bytes, at) != sizeof(data_t)
+  ) {
+    throw "Checkpoint was written on an incompatible platform: " + path;
+  }
+
+  if (
+    unpack<std::uint64_t>(bytes, at) != fingerprint ||
+    unpack<std::uint64_t>(bytes, at) != nObs
+  ) {
+    throw "Checkpoint belongs to a different dataset: " + path;
+  }
+
+  auto runLength = unpack<std::uint64_t>(bytes, at);
+
+  if (
+    runLength > bytes.size() - at ||
+    std::string(bytes.data() + at, runLength) != run
+  ) {
+    throw "Checkpoint belongs to a different run: " + path;
+  }
+
+  at += runLength;
+
+  State loaded;
+  auto nClusters = unpack<std::uint64_t>(bytes, at);
+
+  if (nClusters == 0 || nClusters > nObs) {
+    throw "Checkpoint is corrupt: " + path;
+  }
+
+  for (std::uint64_t k = 0; k < nClusters; k++) {
+    loaded.ids.push_back(unpack<std::uint32_t>(bytes, at));
+    loaded.nn.push_back(unpack<std::int32_t>(bytes, at));
+    loaded.nnDist.push_back(unpack<data_t>(bytes, at));
+
+    // Ids are dendrogram nodes, and each cluster's nearest neighbour is an
+    // earlier cluster, if any.
+    if (
+      loaded.ids.back() >= 2 * nObs - 1 ||
+      loaded.nn.back() < -1 || loaded.nn.back() >= (std::int64_t)k
+    ) {
+      throw "Checkpoint is corrupt: " + path;
+    }
+
+    auto size = unpack<std::uint64_t>(bytes, at);
+    std::vector<index_t> members;
+
+    if (size == 0 || size > nObs) {
+      throw "Checkpoint is corrupt: " + path;
+    }
+
+    for (std::uint64_t m = 0; m < size; m++) {
+      index_t row = unpack<std::uint32_t>(bytes, at);
+
+      if (row >= nObs) {
+        throw "Checkpoint is corrupt: " + path;
+      }
+
+      members.push_back(row);
+    }
+
+    loaded.members.push_back(members);
+  }
+
+  auto nMerges = unpack<std::uint64_t>(bytes, at);
+
+  if (nMerges >= nObs) {
+    throw "Checkpoint is corrupt: " + path;
+  }
+
+  for (std::uint64_t t = 0; t < nMerges; t++) {
+    cluster::agg::Dendrogram::Merge merge;
+    merge.left = unpack<std::uint32_t>(bytes, at);
+    merge.right = unpack<std::uint32_t>(bytes, at);
+    merge.height = unpack<data_t>(bytes, at);
+    merge.size = unpack<std::uint32_t>(bytes, at);
+
+    if (merge.left >= nObs + t || merge.right >= nObs + t) {
+      throw "Checkpoint is corrupt: " + path;
+    }
+
+    loaded.merges.push_back(merge);
+  }
+
+  if (at != bytes.size()) {
+    throw "Checkpoint is corrupt: " + path;
+  }
+
+  state = std::move(loaded);
+  lastSaved = nObs - nClusters;
+  return true;
+}
+
+bool cluster::agg::Checkpoint::due(std::size_t nClusters) {
+  if (nObs - nClusters < lastSaved + every) {
+    return false;
+  }
+
+  if (
+    pending.valid() &&
+    pending.wait_for(std::chrono::seconds(0)) != std::future_status::ready
+  ) {
+    return false;
+  }
+
+  finish();
+  return true;
+}
+
+void cluster::agg::Checkpoint::save(cluster::agg::Checkpoint::State state) {
+  finish();
+  lastSaved = nObs - state.members.size();
+
+  pending = std::async(
+    std::launch::async,
+    [this](State state) {
+      std::vector<char> bytes;
+
+      for (char c : magic) {
+        pack(bytes, c);
+      }
+
+      pack(bytes, version);
+      pack(bytes, byteOrder);
+      pack<std::uint32_t>(bytes, std::numeric_limits<data_t>::digits);
+      pack<std::uint32_t>(bytes, sizeof(data_t));
+      pack(bytes, fingerprint);
+      pack<std::uint64_t>(bytes, nObs);
+      pack<std::uint64_t>(bytes, run.size());
+      bytes.insert(bytes.end(), run.begin(), run.end());
+      pack<std::uint64_t>(bytes, state.members.size());
+
+      for (std::size_t k = 0; k < state.members.size(); k++) {
+        pack<std::uint32_t>(bytes, state.ids[k]);
+        pack<std::int32_t>(bytes, state.nn[k]);
+        pack(bytes, state.nnDist[k]);
+        pack<std::uint64_t>(bytes, state.members[k].size());
+
+        for (auto row : state.members[k]) {
+          pack<std::uint32_t>(bytes, row);
+        }
+      }
+
+      pack<std::uint64_t>(bytes, state.merges.size());
+
+      for (auto& merge : state.merges) {
+        pack<std::uint32_t>(bytes, merge.left);
+        pack<std::uint32_t>(bytes, merge.right);
+        pack(bytes, merge.height);
+        pack<std::uint32_t>(bytes, merge.size);
+      }
+
+      writeFile(path, bytes);
+    },
+    std::move(state)
+  );
+}
+
+void cluster::agg::Checkpoint::finish() {
+  if (pending.valid()) {
+    pending.get();
+  }
+}
+
+void cluster::agg::Checkpoint::complete() {
+  finish();
+
+  if (std::remove(path.c_str()) != 0 && errno != ENOENT) {
+    throw "Can't remove checkpoint " + path + ": " + std::strerror(errno);
+  }
+}
@@ -0,0 +1,89 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include "ns.hpp"
+#include "Dendrogram.hpp"
+
+#include <cstdint>
+#include <future>
+#include <string>
+#include <vector>
+
+// Periodic snapshots of a merge run, so one that gets interrupted can pick
+// up where it left off. Snapshots are written by a background thread while
+// merging carries on, and a new one is only taken once the last has landed,
+// so a slow disk delays snapshots rather than merges.
+//
+// A snapshot belongs to one run: it records the dataset, distance and
+// linkage it came from and refuses to resume anything else. Custom distances
+// and linkages can't be told apart by name, so give runs using them a key
+// of their own. The snapshot is removed once its run completes, so only an
+// interrupted run is ever resumed. A run with another stop criterion may
+// pick it up, but not if the merges so far already go past that criterion.
+//
+// Snapshots are only meant to be read back on the machine, or at least the
+// platform and build, that wrote them: values are stored in the native byte
+// order and long double format, which the header records and checks.
+class cluster::agg::Checkpoint {
+public:
+  using index_t = cluster::index_t;
+  using data_t = cluster::data_t;
+
+  // Everything the merge loop needs to carry on.
+  struct State {
+    // The observations in each active cluster, in the order they were merged.
+    std::vector<std::vector<index_t>> members;
+    // Each active cluster's node in the dendrogram.
+    std::vector<index_t> ids;
+    // Each active cluster's nearest earlier cluster, and the distance to it.
+    std::vector<int> nn;
+    std::vector<data_t> nnDist;
+    std::vector<cluster::agg::Dendrogram::Merge> merges;
+  };
+
+private:
+  std::string path;
+  index_t every;
+  std::string key;
+  // What the snapshot was taken of, set by resume().
+  std::uint64_t fingerprint;
+  std::string run;
+  index_t nObs;
+  index_t lastSaved;
+  std::future<void> pending;
+
+public:
+  // Constructors.
+  Checkpoint(std::string path, index_t every = 1000, std::string key = "");
+  Checkpoint(const Checkpoint&) = delete;
+  Checkpoint& operator=(const Checkpoint&) = delete;
+  ~Checkpoint();
+
+  // Basic information.
+  const std::string& file() const;
+  index_t interval() const;
+
+  // Load the latest snapshot of a run over data into state. Returns false,
+  // leaving state alone, if there isn't one yet.
+  bool resume(
+    const cluster::Dataset& data,
+    cluster::dist::DistanceMeasure dist,
+    cluster::agg::Linkage linkage,
+    State& state
+  );
+
+  // Whether a run down to nClusters clusters is due a snapshot: every()
+  // merges have passed since the last one and it has finished writing.
+  bool due(std::size_t nClusters);
+
+  // Write state out in the background.
+  void save(State state);
+
+  // Wait for the last snapshot to be written, rethrowing any failure.
+  void finish();
+
+  // Wait for the last snapshot, then remove it, since the run is done.
+  void complete();
+};
+
+#endif
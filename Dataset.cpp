@@ -1,29 +1,245 @@
 #include "ns.hpp"
 #include "Dataset.hpp"
+#include "Exec.hpp"
 
+#include <functional>
 #include <sstream>
+#include <unordered_map>
 
-cluster::Dataset::Dataset(cluster::Dataset::index_t numVars) : numVars(numVars) {}
+cluster::Dataset::IndexMap cluster::Dataset::IndexMap::of(
+  std::shared_ptr<const std::vector<cluster::Dataset::index_t>> indices
+) {
+  IndexMap map;
+  map.list = indices->data();
+  map.count = indices->size();
+  map.owner = std::move(indices);
+  return map;
+}
+
+cluster::Dataset::index_t cluster::Dataset::IndexMap::size() const {
+  return this->count;
+}
+
+cluster::Dataset::index_t cluster::Dataset::IndexMap::operator [] (
+  cluster::Dataset::index_t i
+) const {
+  return this->list ? this->list[i] : this->start + i * this->step;
+}
+
+// Unnamed datasets all share one empty set of names.
+static std::shared_ptr<const std::map<std::string, cluster::index_t>>
+noColumnNames() {
+  static const auto none =
+    std::make_shared<const std::map<std::string, cluster::index_t>>();
+  return none;
+}
+
+cluster::Dataset::Dataset(cluster::Dataset::index_t numVars)
+: numVars(numVars), storedVars(numVars), numRows(0),
+  storage(std::make_shared<std::vector<cluster::Dataset::data_t>>()),
+  columnNameIndex(noColumnNames()) {}
 
 cluster::Dataset::Dataset(std::vector<std::string> columnNames)
-: numVars(columnNames.size()) {
+: cluster::Dataset(columnNames.size()) {
+  auto names = std::make_shared<ColumnNames>();
+
   // Map each string back to its original index in the vector.
   for (cluster::Dataset::index_t i = 0; i < columnNames.size(); i++) {
-    this->columnNameIndex[columnNames[i]] = i;
+    (*names)[columnNames[i]] = i;
   }
+
+  this->columnNameIndex = names;
 }
 
 cluster::Dataset::index_t cluster::Dataset::nObs() const {
-  return this->data.size();
+  return this->rowMap ? this->rowMap->size() : this->numRows;
 }
 
 cluster::Dataset::index_t cluster::Dataset::nVars() const {
   return this->numVars;
 }
 
-cluster::Dataset& cluster::Dataset::add(
-  std::vector<cluster::Dataset::data_t> newData
+bool cluster::Dataset::isView() const {
+  return this->rowMap || this->colMap;
+}
+
+bool cluster::Dataset::weighted() const {
+  return this->weightStorage != nullptr;
+}
+
+cluster::Dataset::data_t cluster::Dataset::weight(
+  cluster::Dataset::index_t index
+) const {
+  if (index >= this->nObs()) {
+    std::stringstream s;
+    s << "Index " << index << " is out of bounds";
+    throw s.str();
+  }
+
+  return this->weightStorage ? (*this->weightStorage)[this->storedRow(index)] : 1;
+}
+
+cluster::Dataset::data_t cluster::Dataset::totalWeight() const {
+  if (!this->weightStorage) {
+    return this->nObs();
+  }
+
+  cluster::Dataset::data_t sum = 0;
+
+  for (cluster::Dataset::index_t i = 0; i < this->nObs(); i++) {
+    sum += (*this->weightStorage)[this->storedRow(i)];
+  }
+
+  return sum;
+}
+
+std::vector<cluster::Dataset::data_t> cluster::Dataset::weights() const {
+  std::vector<cluster::Dataset::data_t> scratch;
+  return this->weightSpan(scratch).toVector();
+}
+
+cluster::Dataset::index_t cluster::Dataset::storedRow(
+  cluster::Dataset::index_t index
+) const {
+  return this->rowMap ? (*this->rowMap)[index] : index;
+}
+
+cluster::Dataset::index_t cluster::Dataset::storedCol(
+  cluster::Dataset::index_t index
+) const {
+  return this->colMap ? (*this->colMap)[index] : index;
+}
+
+cluster::Dataset::data_t cluster::Dataset::at(
+  cluster::Dataset::index_t row,
+  cluster::Dataset::index_t col
+) const {
+  return (*this->storage)[
+    (std::size_t)this->storedRow(row) * this->storedVars + this->storedCol(col)
+  ];
+}
+
+cluster::span<const cluster::Dataset::data_t> cluster::Dataset::rowSpan(
+  cluster::Dataset::index_t index,
+  std::vector<cluster::Dataset::data_t>& scratch
+) const {
+  const cluster::Dataset::data_t* base = this->storage->data();
+
+  if (!this->colMap) {
+    return cluster::span<const cluster::Dataset::data_t>(
+      base + (std::size_t)this->storedRow(index) * this->storedVars,
+      this->numVars
+    );
+  }
+
+  scratch.resize(this->numVars);
+
+  for (cluster::Dataset::index_t j = 0; j < this->numVars; j++) {
+    scratch[j] = this->at(index, j);
+  }
+
+  return scratch;
+}
+
+cluster::span<const cluster::Dataset::data_t> cluster::Dataset::colSpan(
+  cluster::Dataset::index_t index,
+  std::vector<cluster::Dataset::data_t>& scratch
+) const {
+  const cluster::Dataset::data_t* base = this->storage->data();
+
+  // Columns of the storage itself, or of a strided slice of it, are just
+  // strided spans; only index-list views need gathering.
+  if (!this->rowMap || !this->rowMap->list) {
+    std::size_t start = this->rowMap ? this->rowMap->start : 0;
+    std::size_t step = this->rowMap ? this->rowMap->step : 1;
+
+    return cluster::span<const cluster::Dataset::data_t>(
+      base + start * this->storedVars + this->storedCol(index),
+      this->nObs(),
+      step * this->storedVars
+    );
+  }
+
+  scratch.resize(this->nObs());
+
+  for (cluster::Dataset::index_t i = 0; i < this->nObs(); i++) {
+    scratch[i] = this->at(i, index);
+  }
+
+  return scratch;
+}
+
+cluster::span<const cluster::Dataset::data_t> cluster::Dataset::weightSpan(
+  std::vector<cluster::Dataset::data_t>& scratch
+) const {
+  if (this->weightStorage && (!this->rowMap || !this->rowMap->list)) {
+    std::size_t start = this->rowMap ? this->rowMap->start : 0;
+    std::size_t step = this->rowMap ? this->rowMap->step : 1;
+
+    return cluster::span<const cluster::Dataset::data_t>(
+      this->weightStorage->data() + start,
+      this->nObs(),
+      step
+    );
+  }
+
+  scratch.resize(this->nObs());
+
+  for (cluster::Dataset::index_t i = 0; i < this->nObs(); i++) {
+    scratch[i] = this->weightStorage
+      ? (*this->weightStorage)[this->storedRow(i)]
+      : 1;
+  }
+
+  return scratch;
+}
+
+cluster::Dataset cluster::Dataset::rowView(
+  cluster::Dataset::IndexMap map
+) const {
+  cluster::Dataset view(*this);
+
+  // Compose the new map with this dataset's own so the view always refers
+  // straight to the storage.
+  if (this->rowMap) {
+    if (!this->rowMap->list && !map.list) {
+      map.start = (*this->rowMap)[map.start];
+      map.step *= this->rowMap->step;
+    } else {
+      auto composed = std::make_shared<std::vector<cluster::Dataset::index_t>>();
+      composed->reserve(map.size());
+
+      for (cluster::Dataset::index_t i = 0; i < map.size(); i++) {
+        composed->push_back((*this->rowMap)[map[i]]);
+      }
+
+      map = IndexMap::of(composed);
+    }
+  }
+
+  view.rowMap = map;
+  return view;
+}
+
+void cluster::Dataset::detach() {
+  if (!this->isView() && this->storage.use_count() == 1) {
+    return;
+  }
+
+  cluster::Dataset owned = this->materialize();
+  *this = owned;
+}
+
+void cluster::Dataset::append(
+  cluster::span<const cluster::Dataset::data_t> newData,
+  cluster::Dataset::data_t weight
 ) {
+  if (!(weight > 0)) {
+    std::stringstream s;
+    s << "Expected a positive weight; instead found " << weight;
+    throw s.str();
+  }
+
   if (newData.size() != numVars) {
     std::stringstream s;
     s << "Expected " << numVars << " entries in data entry; "
@@ -31,17 +247,45 @@ cluster::Dataset& cluster::Dataset::add(
     throw s.str();
   }
 
-  this->data.push_back(newData);
+  this->detach();
+  this->storage->insert(this->storage->end(), newData.begin(), newData.end());
+  this->numRows++;
+
+  if (weight != 1 && !this->weightStorage) {
+    this->weightStorage = std::make_shared<std::vector<cluster::Dataset::data_t>>(
+      this->numRows - 1, 1
+    );
+  }
+
+  if (this->weightStorage) {
+    this->weightStorage->push_back(weight);
+  }
+}
+
+cluster::Dataset& cluster::Dataset::add(
+  const std::vector<cluster::Dataset::data_t>& newData
+) {
+  this->append(newData, 1);
   return *this;
 }
 
 cluster::Dataset& cluster::Dataset::add(
-  std::vector<std::vector<cluster::Dataset::data_t>> newData
+  const std::vector<cluster::Dataset::data_t>& newData,
+  cluster::Dataset::data_t weight
+) {
+  this->append(newData, weight);
+  return *this;
+}
+
+cluster::Dataset& cluster::Dataset::add(
+  const std::vector<std::vector<cluster::Dataset::data_t>>& newData
 ) {
   std::stringstream errorMessage;
   errorMessage << "The following errors were encountered:\n";
   bool errors = false;
 
+  this->reserve(newData.size());
+
   for (auto it = newData.begin(); it != newData.end(); ++it) {
     try {
       this->add(*it);
@@ -59,17 +303,28 @@ cluster::Dataset& cluster::Dataset::add(
 }
 
 cluster::Dataset& cluster::Dataset::operator += (
-  std::vector<cluster::Dataset::data_t> newData
+  const std::vector<cluster::Dataset::data_t>& newData
 ) {
   return this->add(newData);
 }
 
 cluster::Dataset& cluster::Dataset::operator += (
-  std::vector<std::vector<cluster::Dataset::data_t>> newData
+  const std::vector<std::vector<cluster::Dataset::data_t>>& newData
 ) {
   return this->add(newData);
 }
 
+void cluster::Dataset::reserve(cluster::Dataset::index_t moreRows) {
+  this->detach();
+  this->storage->reserve(
+    this->storage->size() + (std::size_t)moreRows * this->numVars
+  );
+
+  if (this->weightStorage) {
+    this->weightStorage->reserve(this->weightStorage->size() + moreRows);
+  }
+}
+
 cluster::Dataset cluster::Dataset::operator + (
   const cluster::Dataset& other
 ) const {
@@ -84,22 +339,52 @@ cluster::Dataset cluster::Dataset::operator + (
 
   // Make sure the column names are the same.
   if (
-    this->columnNameIndex.size() != other.columnNameIndex.size() ||
-    !std::equal(
-      this->columnNameIndex.begin(),
-      this->columnNameIndex.end(),
-      other.columnNameIndex.begin()
-    )
+    this->columnNameIndex != other.columnNameIndex &&
+    *this->columnNameIndex != *other.columnNameIndex
   ) {
     std::stringstream s;
     throw "Can't add datasets with differing column names";
   }
 
+  // If both sides read the same columns of the same storage, the result can
+  // simply be a view over both sets of rows.
+  bool sameCols = this->storage == other.storage &&
+    this->colMap.has_value() == other.colMap.has_value();
+
+  for (
+    cluster::Dataset::index_t j = 0;
+    sameCols && this->colMap && j < this->numVars;
+    j++
+  ) {
+    sameCols = (*this->colMap)[j] == (*other.colMap)[j];
+  }
+
+  if (sameCols) {
+    auto indices = std::make_shared<std::vector<cluster::Dataset::index_t>>();
+    indices->reserve(this->nObs() + other.nObs());
+
+    for (cluster::Dataset::index_t i = 0; i < this->nObs(); i++) {
+      indices->push_back(this->storedRow(i));
+    }
+
+    for (cluster::Dataset::index_t i = 0; i < other.nObs(); i++) {
+      indices->push_back(other.storedRow(i));
+    }
+
+    cluster::Dataset combined(*this);
+    combined.rowMap = IndexMap::of(indices);
+    return combined;
+  }
+
   // Add the maps.
-  cluster::Dataset combined(this->numVars);
-  combined.columnNameIndex = this->columnNameIndex;
-  combined.data = this->data;
-  combined += other.data;
+  cluster::Dataset combined = this->materialize();
+  std::vector<cluster::Dataset::data_t> scratch;
+  combined.reserve(other.nObs());
+
+  for (cluster::Dataset::index_t i = 0; i < other.nObs(); i++) {
+    combined.append(other.rowSpan(i, scratch), other.weight(i));
+  }
+
   return combined;
 }
 
@@ -112,7 +397,14 @@ std::vector<cluster::Dataset::data_t> cluster::Dataset::row(
     throw s.str();
   }
 
-  return this->data[index];
+  std::vector<cluster::Dataset::data_t> row;
+  row.reserve(this->numVars);
+
+  for (cluster::Dataset::index_t j = 0; j < this->numVars; j++) {
+    row.push_back(this->at(index, j));
+  }
+
+  return row;
 }
 
 cluster::Dataset cluster::Dataset::rows(
@@ -122,16 +414,10 @@ cluster::Dataset cluster::Dataset::rows(
   errorMessage << "The following errors were encountered:\n";
   bool errors = false;
 
-  // Prepare the new dataset.
-  cluster::Dataset newSet(this->numVars);
-  newSet.columnNameIndex = this->columnNameIndex;
-
   for (auto it = indices.begin(); it != indices.end(); ++it) {
-    try {
-      newSet += this->row(*it);
-    } catch (std::string error) {
+    if (*it >= this->nObs()) {
       errors = true;
-      errorMessage << "  " << error << "\n";
+      errorMessage << "  Index " << *it << " is out of bounds\n";
     }
   }
 
@@ -139,7 +425,82 @@ cluster::Dataset cluster::Dataset::rows(
     throw errorMessage.str();
   }
 
-  return newSet;
+  return this->rowView(IndexMap::of(
+    std::make_shared<const std::vector<cluster::Dataset::index_t>>(
+      std::move(indices)
+    )
+  ));
+}
+
+cluster::span<const cluster::Dataset::data_t> cluster::Dataset::row(
+  cluster::Dataset::index_t index,
+  std::vector<cluster::Dataset::data_t>& scratch
+) const {
+  if (index >= this->nObs()) {
+    std::stringstream s;
+    s << "Index " << index << " is out of bounds";
+    throw s.str();
+  }
+
+  return this->rowSpan(index, scratch);
+}
+
+cluster::Dataset cluster::Dataset::rows(
+  const cluster::Dataset::index_t* first,
+  cluster::Dataset::index_t count,
+  std::shared_ptr<const void> owner
+) const {
+  for (cluster::Dataset::index_t i = 0; i < count; i++) {
+    if (first[i] >= this->nObs()) {
+      std::stringstream s;
+      s << "Index " << first[i] << " is out of bounds";
+      throw s.str();
+    }
+  }
+
+  IndexMap map;
+  map.list = first;
+  map.count = count;
+  map.owner = std::move(owner);
+  return this->rowView(map);
+}
+
+cluster::Dataset cluster::Dataset::storedRows(
+  std::vector<cluster::Dataset::index_t>* rows
+) const {
+  if (rows) {
+    rows->resize(this->nObs());
+
+    for (cluster::Dataset::index_t i = 0; i < this->nObs(); i++) {
+      (*rows)[i] = this->storedRow(i);
+    }
+  }
+
+  cluster::Dataset stored(*this);
+  stored.rowMap.reset();
+  return stored;
+}
+
+cluster::Dataset cluster::Dataset::slice(
+  cluster::Dataset::index_t start,
+  cluster::Dataset::index_t stop,
+  cluster::Dataset::index_t step
+) const {
+  if (step == 0) {
+    throw std::string("Slice step must be positive");
+  }
+
+  if (start > stop || stop > this->nObs()) {
+    std::stringstream s;
+    s << "Slice [" << start << ", " << stop << ") is out of bounds";
+    throw s.str();
+  }
+
+  IndexMap map;
+  map.start = start;
+  map.step = step;
+  map.count = (stop - start + step - 1) / step;
+  return this->rowView(map);
 }
 
 std::vector<cluster::Dataset::data_t> cluster::Dataset::operator [] (
@@ -151,7 +512,7 @@ std::vector<cluster::Dataset::data_t> cluster::Dataset::operator [] (
 cluster::Dataset cluster::Dataset::operator [] (
   std::vector<cluster::Dataset::index_t> indices
 ) const {
-  return this->rows(indices);
+  return this->rows(std::move(indices));
 }
 
 std::vector<cluster::Dataset::data_t> cluster::Dataset::col(
@@ -164,9 +525,10 @@ std::vector<cluster::Dataset::data_t> cluster::Dataset::col(
   }
 
   std::vector<cluster::Dataset::data_t> column;
+  column.reserve(this->nObs());
 
-  for (auto it = this->data.begin(); it != this->data.end(); ++it) {
-    column.push_back((*it)[index]);
+  for (cluster::Dataset::index_t i = 0; i < this->nObs(); i++) {
+    column.push_back(this->at(i, index));
   }
 
   return column;
@@ -175,15 +537,15 @@ std::vector<cluster::Dataset::data_t> cluster::Dataset::col(
 std::vector<cluster::Dataset::data_t> cluster::Dataset::col(
   std::string name
 ) const {
-  auto it = this->columnNameIndex.find(name);
+  auto it = this->columnNameIndex->find(name);
 
-  if (it == this->columnNameIndex.end()) {
+  if (it == this->columnNameIndex->end()) {
     std::stringstream s;
     s << "No column with name '" << name << "' exists";
     throw s.str();
   }
 
-  return this->col(this->columnNameIndex.at(name));
+  return this->col(it->second);
 }
 
 std::vector<cluster::Dataset::data_t> cluster::Dataset::col(
@@ -198,15 +560,20 @@ cluster::Dataset cluster::Dataset::cols(
   std::stringstream errorMessage;
   errorMessage << "The following errors were encountered:\n";
   bool errors = false;
-  auto colNameMap = cluster::Dataset::reverse(this->columnNameIndex);
-  std::vector<std::string> colNames;
+  auto colNameMap = cluster::Dataset::reverse(*this->columnNameIndex);
+  auto colNames = std::make_shared<ColumnNames>();
+  auto stored = std::make_shared<std::vector<cluster::Dataset::index_t>>();
 
   for (auto it = indices.begin(); it != indices.end(); ++it) {
     if (*it >= this->numVars) {
       errors = true;
       errorMessage << "  Index " << *it << " is out of bounds\n";
     } else {
-      colNames.push_back(colNameMap[*it]);
+      if (colNameMap.count(*it)) {
+        (*colNames)[colNameMap[*it]] = stored->size();
+      }
+
+      stored->push_back(this->storedCol(*it));
     }
   }
 
@@ -214,45 +581,35 @@ cluster::Dataset cluster::Dataset::cols(
     throw errorMessage.str();
   }
 
-  cluster::Dataset newSet(colNames);
-
-  for (auto it = this->data.begin(); it != this->data.end(); ++it) {
-    std::vector<cluster::Dataset::data_t> newRow;
-    auto row = *it;
-
-    for (auto iIt = indices.begin(); iIt != indices.end(); ++iIt) {
-      newRow.push_back(row[*iIt]);
-    }
-
-    newSet += newRow;
-  }
-
-  return newSet;
+  cluster::Dataset view(*this);
+  view.numVars = stored->size();
+  view.colMap = IndexMap::of(stored);
+  view.columnNameIndex = colNames->empty() ? noColumnNames() : colNames;
+  return view;
 }
 
 cluster::Dataset cluster::Dataset::cols(std::vector<std::string> names) const {
   std::stringstream errorMessage;
   errorMessage << "The following errors were encountered:\n";
   bool errors = false;
+  std::vector<cluster::Dataset::index_t> indices;
 
-  for (auto it = names.begin(); it == names.end(); ++it) {
-    if (this->columnNameIndex.find(*it) == this->columnNameIndex.end()) {
+  for (auto it = names.begin(); it != names.end(); ++it) {
+    auto found = this->columnNameIndex->find(*it);
+
+    if (found == this->columnNameIndex->end()) {
       errors = true;
       errorMessage << "  No column with name '" << *it << "' exists\n";
+    } else {
+      indices.push_back(found->second);
     }
   }
 
-  cluster::Dataset newSet(names);
-  for (auto it = this->data.begin(); it != this->data.end(); ++it) {
-    auto row = *it;
-    std::vector<cluster::Dataset::data_t> newRow;
-
-    for (auto nIt = names.begin(); nIt != names.end(); nIt++) {
-      newRow.push_back(row[this->columnNameIndex.at(*nIt)]);
-    }
+  if (errors) {
+    throw errorMessage.str();
   }
 
-  return newSet;
+  return this->cols(std::move(indices));
 }
 
 cluster::Dataset cluster::Dataset::cols(std::vector<const char*> names) const {
@@ -288,7 +645,7 @@ std::vector<cluster::Dataset::data_t> cluster::Dataset::operator () (
 cluster::Dataset cluster::Dataset::operator () (
   std::vector<cluster::Dataset::index_t> indices
 ) const {
-  return this->cols(indices);
+  return this->cols(std::move(indices));
 }
 
 cluster::Dataset cluster::Dataset::operator () (
@@ -303,44 +660,249 @@ cluster::Dataset cluster::Dataset::operator () (
   return this->cols(names);
 }
 
-std::vector<cluster::Dataset::data_t> cluster::Dataset::applyRow(
-  cluster::Dataset::Aggregator a
+cluster::Dataset cluster::Dataset::materialize() const {
+  cluster::Dataset owned(this->numVars);
+  owned.columnNameIndex = this->columnNameIndex;
+  owned.numRows = this->nObs();
+  owned.storage->reserve((std::size_t)owned.numRows * this->numVars);
+
+  for (cluster::Dataset::index_t i = 0; i < this->nObs(); i++) {
+    for (cluster::Dataset::index_t j = 0; j < this->numVars; j++) {
+      owned.storage->push_back(this->at(i, j));
+    }
+  }
+
+  if (this->weightStorage) {
+    owned.weightStorage = std::make_shared<std::vector<cluster::Dataset::data_t>>(
+      this->weights()
+    );
+  }
+
+  return owned;
+}
+
+cluster::Dataset cluster::Dataset::collapse(
+  std::vector<cluster::Dataset::index_t>* groups,
+  cluster::exec::Policy policy
 ) const {
-  std::vector<cluster::Dataset::data_t> result;
+  cluster::Dataset::index_t n = this->nObs();
+  std::vector<std::size_t> hashes(n);
+
+  // Hash every row up front (in parallel), then group equal rows serially.
+  cluster::exec::parallelFor(
+    n,
+    policy,
+    [&](std::size_t begin, std::size_t end, unsigned int) {
+      std::hash<cluster::Dataset::data_t> hash;
+
+      for (std::size_t i = begin; i < end; i++) {
+        std::size_t h = 0;
+
+        for (cluster::Dataset::index_t j = 0; j < this->numVars; j++) {
+          h ^= hash(this->at(i, j)) + 0x9e3779b97f4a7c15 + (h << 6) + (h >> 2);
+        }
+
+        hashes[i] = h;
+      }
+    }
+  );
+
+  cluster::Dataset unique(this->numVars);
+  unique.columnNameIndex = this->columnNameIndex;
+  std::vector<cluster::Dataset::index_t> firstRow;
+  std::vector<cluster::Dataset::data_t> totals;
+  std::unordered_multimap<std::size_t, cluster::Dataset::index_t> seen;
+
+  if (groups) {
+    groups->resize(n);
+  }
+
+  for (cluster::Dataset::index_t i = 0; i < n; i++) {
+    auto range = seen.equal_range(hashes[i]);
+    cluster::Dataset::index_t group = firstRow.size();
+
+    for (auto it = range.first; it != range.second; ++it) {
+      bool same = true;
+
+      for (cluster::Dataset::index_t j = 0; same && j < this->numVars; j++) {
+        same = this->at(i, j) == this->at(firstRow[it->second], j);
+      }
+
+      if (same) {
+        group = it->second;
+        break;
+      }
+    }
+
+    if (group == firstRow.size()) {
+      seen.insert({hashes[i], group});
+      firstRow.push_back(i);
+      totals.push_back(0);
+    }
+
+    totals[group] += this->weight(i);
+
+    if (groups) {
+      (*groups)[i] = group;
+    }
+  }
+
+  std::vector<cluster::Dataset::data_t> scratch;
+  unique.reserve(firstRow.size());
 
-  for (auto row : this->data) {
-    result.push_back(a(row));
+  for (cluster::Dataset::index_t g = 0; g < firstRow.size(); g++) {
+    unique.append(this->rowSpan(firstRow[g], scratch), totals[g]);
   }
 
+  return unique;
+}
+
+std::vector<cluster::Dataset::data_t> cluster::Dataset::applyRow(
+  cluster::Dataset::Aggregator a,
+  cluster::exec::Policy policy
+) const {
+  std::vector<cluster::Dataset::data_t> result(this->nObs());
+  this->applyRow(a, result, policy);
   return result;
 }
 
 std::vector<cluster::Dataset::data_t> cluster::Dataset::applyCol(
-  cluster::Dataset::Aggregator a
+  cluster::Dataset::Aggregator a,
+  cluster::exec::Policy policy
+) const {
+  std::vector<cluster::Dataset::data_t> result(this->numVars);
+  this->applyCol(a, result, policy);
+  return result;
+}
+
+void cluster::Dataset::applyRow(
+  cluster::Dataset::Aggregator a,
+  cluster::span<cluster::Dataset::data_t> out,
+  cluster::exec::Policy policy
+) const {
+  if (out.size() != this->nObs()) {
+    std::stringstream s;
+    s << "Expected output space for " << this->nObs() << " rows; "
+      << "instead found " << out.size();
+    throw s.str();
+  }
+
+  // Rows are already contiguous, so vectorized runs like serial.
+  std::vector<std::vector<cluster::Dataset::data_t>> scratch(
+    policy == cluster::exec::Policy::threads ? cluster::exec::concurrency() : 1
+  );
+
+  cluster::exec::parallelFor(
+    this->nObs(),
+    policy,
+    [&](std::size_t begin, std::size_t end, unsigned int worker) {
+      for (std::size_t i = begin; i < end; i++) {
+        out[i] = a(this->rowSpan(i, scratch[worker]));
+      }
+    }
+  );
+}
+
+void cluster::Dataset::applyCol(
+  cluster::Dataset::Aggregator a,
+  cluster::span<cluster::Dataset::data_t> out,
+  cluster::exec::Policy policy
 ) const {
-  std::vector<cluster::Dataset::data_t> result;
+  if (out.size() != this->numVars) {
+    std::stringstream s;
+    s << "Expected output space for " << this->numVars << " columns; "
+      << "instead found " << out.size();
+    throw s.str();
+  }
 
-  for (cluster::Dataset::index_t i = 0; i < this->numVars; i++) {
-    result.push_back(a(this->col(i)));
+  if (policy == cluster::exec::Policy::vectorized) {
+    // Transpose blocks of columns into contiguous buffers, reading each row
+    // once per block, so the aggregator runs over unit-stride memory.
+    const cluster::Dataset::index_t block = 16;
+    cluster::Dataset::index_t n = this->nObs();
+    std::vector<cluster::Dataset::data_t> buffer((std::size_t)block * n);
+
+    for (cluster::Dataset::index_t j0 = 0; j0 < this->numVars; j0 += block) {
+      cluster::Dataset::index_t width = std::min(block, this->numVars - j0);
+
+      for (cluster::Dataset::index_t i = 0; i < n; i++) {
+        for (cluster::Dataset::index_t b = 0; b < width; b++) {
+          buffer[(std::size_t)b * n + i] = this->at(i, j0 + b);
+        }
+      }
+
+      for (cluster::Dataset::index_t b = 0; b < width; b++) {
+        out[j0 + b] = a(cluster::span<const cluster::Dataset::data_t>(
+          buffer.data() + (std::size_t)b * n,
+          n
+        ));
+      }
+    }
+
+    return;
   }
 
+  std::vector<std::vector<cluster::Dataset::data_t>> scratch(
+    policy == cluster::exec::Policy::threads ? cluster::exec::concurrency() : 1
+  );
+
+  cluster::exec::parallelFor(
+    this->numVars,
+    policy,
+    [&](std::size_t begin, std::size_t end, unsigned int worker) {
+      for (std::size_t j = begin; j < end; j++) {
+        out[j] = a(this->colSpan(j, scratch[worker]));
+      }
+    }
+  );
+}
+
+std::vector<cluster::Dataset::data_t> cluster::Dataset::applyColWeighted(
+  cluster::Dataset::WeightedAggregator a,
+  cluster::exec::Policy policy
+) const {
+  std::vector<cluster::Dataset::data_t> result(this->numVars);
+  std::vector<cluster::Dataset::data_t> weightScratch;
+  auto weights = this->weightSpan(weightScratch);
+  std::vector<std::vector<cluster::Dataset::data_t>> scratch(
+    policy == cluster::exec::Policy::threads ? cluster::exec::concurrency() : 1
+  );
+
+  cluster::exec::parallelFor(
+    this->numVars,
+    policy,
+    [&](std::size_t begin, std::size_t end, unsigned int worker) {
+      for (std::size_t j = begin; j < end; j++) {
+        result[j] = a(this->colSpan(j, scratch[worker]), weights);
+      }
+    }
+  );
+
   return result;
 }
 
 cluster::Dataset cluster::Dataset::standardize() {
-  auto means = this->applyCol(cluster::stat::mean);
-  auto sds = this->applyCol(cluster::stat::sd);
+  std::vector<cluster::Dataset::data_t> means, sds;
+
+  if (this->weighted()) {
+    means = this->applyColWeighted(cluster::stat::mean);
+    sds = this->applyColWeighted(cluster::stat::sd);
+  } else {
+    means = this->applyCol(cluster::stat::mean);
+    sds = this->applyCol(cluster::stat::sd);
+  }
+
   cluster::Dataset d(this->numVars);
   d.columnNameIndex = this->columnNameIndex;
+  d.reserve(this->nObs());
+  std::vector<cluster::Dataset::data_t> row(this->numVars);
 
   for (cluster::Dataset::index_t i = 0; i < this->nObs(); i++) {
-    std::vector<cluster::Dataset::data_t> row;
-
     for (cluster::Dataset::index_t j = 0; j < this->numVars; j++) {
-      row.push_back((data[i][j] - means[j]) / sds[j]);
+      row[j] = (this->at(i, j) - means[j]) / sds[j];
     }
 
-    d.add(row);
+    d.append(row, this->weight(i));
   }
 
   return d;
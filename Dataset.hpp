@@ -2,32 +2,80 @@
 #define DATASET_H
 
 #include "ns.hpp"
+#include "Span.hpp"
 
 #include <vector>
 #include <map>
+#include <memory>
+#include <optional>
 #include <string>
 
 class cluster::Dataset {
 public:
-  using index_t = unsigned int;
+  using index_t = cluster::index_t;
   using data_t = cluster::data_t;
-  using Aggregator = data_t (std::vector<data_t>);
+  using Aggregator = data_t (cluster::span<const data_t>);
+  using WeightedAggregator = data_t (
+    cluster::span<const data_t> data,
+    cluster::span<const data_t> weights
+  );
 
 private:
+  using ColumnNames = std::map<std::string, index_t>;
+
+  // Maps a view's indices onto the indices of the underlying storage, either
+  // through an explicit list or through a start/step stride. A list is kept
+  // alive by owner, which is either its own vector or whatever it borrows
+  // from.
+  struct IndexMap {
+    const index_t* list = nullptr;
+    std::shared_ptr<const void> owner;
+    index_t start = 0;
+    index_t step = 1;
+    index_t count = 0;
+
+    static IndexMap of(std::shared_ptr<const std::vector<index_t>> indices);
+    index_t size() const;
+    index_t operator [] (index_t i) const;
+  };
+
+  // Row-major storage, shared between a dataset and all views of it.
   index_t numVars;
-  std::vector<std::vector<data_t>> data;
-  std::map<std::string, index_t> columnNameIndex;
+  index_t storedVars;
+  index_t numRows;
+  std::shared_ptr<std::vector<data_t>> storage;
+  std::shared_ptr<std::vector<data_t>> weightStorage;
+  std::optional<IndexMap> rowMap;
+  std::optional<IndexMap> colMap;
+  // Shared between a dataset and its views; never null.
+  std::shared_ptr<const ColumnNames> columnNameIndex;
 
   template<class K, class V>
-  static std::map<V, K> reverse(std::map<K, V> map);
+  static std::map<V, K> reverse(const std::map<K, V>& map);
 
   template<class T>
   static std::vector<std::vector<T>> transpose(
-    std::vector<std::vector<T>> data,
+    const std::vector<std::vector<T>>& data,
     unsigned int nRows,
     unsigned int nCols
   );
 
+  index_t storedRow(index_t index) const;
+  index_t storedCol(index_t index) const;
+  data_t at(index_t row, index_t col) const;
+  cluster::span<const data_t> rowSpan(
+    index_t index,
+    std::vector<data_t>& scratch
+  ) const;
+  cluster::span<const data_t> colSpan(
+    index_t index,
+    std::vector<data_t>& scratch
+  ) const;
+  cluster::span<const data_t> weightSpan(std::vector<data_t>& scratch) const;
+  cluster::Dataset rowView(IndexMap map) const;
+  void detach();
+  void append(cluster::span<const data_t> newData, data_t weight);
+
 public:
   // Constructors.
   Dataset(index_t numVars);
@@ -38,23 +86,63 @@ public:
   // Basic information.
   index_t nObs() const;
   index_t nVars() const;
+  bool isView() const;
+
+  // Observation weights, as frequencies. Unless a row is added with a
+  // weight, every row weighs 1.
+  bool weighted() const;
+  data_t weight(index_t index) const;
+  data_t totalWeight() const;
+  std::vector<data_t> weights() const;
+
+  // Add data. Adding to a view (or to a dataset that views still share)
+  // first gives it its own copy of the data. Rows are copied into the
+  // dataset's flat storage, so there's nothing to gain by moving them in.
+  cluster::Dataset& add(const std::vector<data_t>& newData);
+  cluster::Dataset& add(const std::vector<data_t>& newData, data_t weight);
+  cluster::Dataset& add(const std::vector<std::vector<data_t>>& newData);
+  cluster::Dataset& operator += (const std::vector<data_t>& newData);
+  cluster::Dataset& operator += (
+    const std::vector<std::vector<data_t>>& newData
+  );
 
-  // Add data.
-  cluster::Dataset& add(std::vector<data_t> newData);
-  cluster::Dataset& add(std::vector<std::vector<data_t>> newData);
-  cluster::Dataset& operator += (std::vector<data_t> newData);
-  cluster::Dataset& operator += (std::vector<std::vector<data_t>> newData);
+  // Make room for this many more rows, so adding them doesn't reallocate.
+  void reserve(index_t moreRows);
 
-  // Combine two maps into a new map.
+  // Combine two maps into a new map. Views of the same data combine into
+  // another view.
   cluster::Dataset operator + (const cluster::Dataset& other) const;
 
-  // Access rows.
+  // Access rows. Subsets are views sharing this dataset's storage.
   std::vector<data_t> row(index_t index) const;
   cluster::Dataset rows(std::vector<index_t> indices) const;
+  cluster::Dataset slice(index_t start, index_t stop, index_t step = 1) const;
   std::vector<data_t> operator [] (index_t index) const;
   cluster::Dataset operator [] (std::vector<index_t> indices) const;
 
-  // Access cols.
+  // A row in place where the layout allows it, otherwise gathered into
+  // scratch, so reading rows in a loop needn't allocate.
+  cluster::span<const data_t> row(
+    index_t index,
+    std::vector<data_t>& scratch
+  ) const;
+
+  // A view of the count rows listed at first, without copying the list. The
+  // list must stay put and unchanged for as long as the view is used;
+  // owner, if given, is held on to for that long.
+  cluster::Dataset rows(
+    const index_t* first,
+    index_t count,
+    std::shared_ptr<const void> owner = nullptr
+  ) const;
+
+  // Every row of the storage under this dataset, keeping its columns, and
+  // in rows (if given) the row of that behind each of this dataset's rows.
+  // Views taken of the result refer straight to the storage, so taking many
+  // of them needn't compose their row lists with this dataset's.
+  cluster::Dataset storedRows(std::vector<index_t>* rows = nullptr) const;
+
+  // Access cols. Subsets are views sharing this dataset's storage.
   std::vector<data_t> col(index_t index) const;
   std::vector<data_t> col(std::string name) const;
   std::vector<data_t> col(const char* name) const;
@@ -68,14 +156,46 @@ public:
   cluster::Dataset operator () (std::vector<std::string> names) const;
   cluster::Dataset operator () (std::vector<const char*> names) const;
 
-  // Computation.
-  std::vector<data_t> applyRow(Aggregator a) const;
-  std::vector<data_t> applyCol(Aggregator a) const;
+  // Copy a view into a dataset with its own storage.
+  cluster::Dataset materialize() const;
+
+  // Collapse identical rows into one row carrying their total weight, in
+  // order of first appearance. groups, if given, receives the new row of
+  // every original row.
+  cluster::Dataset collapse(
+    std::vector<index_t>* groups = nullptr,
+    cluster::exec::Policy policy = cluster::exec::Policy::threads
+  ) const;
+
+  // Computation. Aggregators see each row or column in place wherever the
+  // layout allows it; the span overloads write into a preallocated output.
+  std::vector<data_t> applyRow(
+    Aggregator a,
+    cluster::exec::Policy policy = cluster::exec::Policy::serial
+  ) const;
+  std::vector<data_t> applyCol(
+    Aggregator a,
+    cluster::exec::Policy policy = cluster::exec::Policy::serial
+  ) const;
+  void applyRow(
+    Aggregator a,
+    cluster::span<data_t> out,
+    cluster::exec::Policy policy = cluster::exec::Policy::serial
+  ) const;
+  void applyCol(
+    Aggregator a,
+    cluster::span<data_t> out,
+    cluster::exec::Policy policy = cluster::exec::Policy::serial
+  ) const;
+  std::vector<data_t> applyColWeighted(
+    WeightedAggregator a,
+    cluster::exec::Policy policy = cluster::exec::Policy::serial
+  ) const;
   cluster::Dataset standardize();
 };
 
 template<class K, class V>
-std::map<V, K> cluster::Dataset::reverse(std::map<K, V> map) {
+std::map<V, K> cluster::Dataset::reverse(const std::map<K, V>& map) {
   std::map<V, K> rev;
 
   for (auto it = map.begin(); it != map.end(); it++) {
@@ -87,18 +207,18 @@ std::map<V, K> cluster::Dataset::reverse(std::map<K, V> map) {
 
 template<class T>
 std::vector<std::vector<T>> cluster::Dataset::transpose(
-  std::vector<std::vector<T>> data,
+  const std::vector<std::vector<T>>& data,
   unsigned int nRows,
   unsigned int nCols
 ) {
-  std::vector<std::vector<T>> trans;
+  std::vector<std::vector<T>> trans(nCols);
 
-  for (unsigned int i = 0; i < nCols; i++) {
-    trans.push_back(std::vector<T>());
+  for (unsigned int j = 0; j < nCols; j++) {
+    trans[j].reserve(nRows);
   }
 
-  for (unsigned int i = 0; i < data.size(); i++) {
-    for (unsigned int j = 0; j < data.size(); j++) {
+  for (unsigned int i = 0; i < nRows; i++) {
+    for (unsigned int j = 0; j < nCols; j++) {
       trans[j].push_back(data[i][j]);
     }
   }
@@ -0,0 +1,142 @@
+#include "ns.hpp"
+#include "Dendrogram.hpp"
+#include "DistanceMatrix.hpp"
+
+#include <numeric>
+#include <sstream>
+
+cluster::agg::Dendrogram::Dendrogram(
+  cluster::agg::Dendrogram::index_t numLeaves
+) : numLeaves(numLeaves), sizes(numLeaves, 1) {
+  // A full tree takes n - 1 merges, so make room for them all up front.
+  if (numLeaves > 0) {
+    this->merges.reserve(numLeaves - 1);
+    this->sizes.reserve(2 * numLeaves - 1);
+  }
+}
+
+cluster::agg::Dendrogram::index_t cluster::agg::Dendrogram::nLeaves() const {
+  return this->numLeaves;
+}
+
+cluster::agg::Dendrogram::index_t cluster::agg::Dendrogram::nNodes() const {
+  return this->sizes.size();
+}
+
+cluster::agg::Dendrogram::index_t cluster::agg::Dendrogram::size(
+  cluster::agg::Dendrogram::index_t node
+) const {
+  if (node >= this->nNodes()) {
+    std::stringstream s;
+    s << "Node " << node << " is out of bounds";
+    throw s.str();
+  }
+
+  return this->sizes[node];
+}
+
+const std::vector<cluster::agg::Dendrogram::Merge>&
+cluster::agg::Dendrogram::steps() const {
+  return this->merges;
+}
+
+cluster::agg::Dendrogram::index_t cluster::agg::Dendrogram::merge(
+  cluster::agg::Dendrogram::index_t left,
+  cluster::agg::Dendrogram::index_t right,
+  cluster::agg::Dendrogram::data_t height
+) {
+  if (left >= this->nNodes() || right >= this->nNodes() || left == right) {
+    std::stringstream s;
+    s << "Can't merge nodes " << left << " and " << right
+      << " in a dendrogram of " << this->nNodes() << " nodes";
+    throw s.str();
+  }
+
+  index_t size = this->sizes[left] + this->sizes[right];
+  this->merges.push_back({left, right, height, size});
+  this->sizes.push_back(size);
+  return this->nNodes() - 1;
+}
+
+std::vector<cluster::agg::Dendrogram::index_t> cluster::agg::Dendrogram::cut(
+  cluster::agg::Dendrogram::index_t k
+) const {
+  index_t nMerges = this->merges.size();
+
+  if (k == 0 || k > this->numLeaves || this->numLeaves - k > nMerges) {
+    std::stringstream s;
+    s << "Can't cut a dendrogram of " << this->numLeaves << " leaves and "
+      << nMerges << " merges into " << k << " clusters";
+    throw s.str();
+  }
+
+  // Union-find over the first n - k merges.
+  std::vector<index_t> parent(this->nNodes());
+  std::iota(parent.begin(), parent.end(), 0);
+
+  auto find = [&](index_t x) {
+    while (parent[x] != x) {
+      parent[x] = parent[parent[x]];
+      x = parent[x];
+    }
+
+    return x;
+  };
+
+  for (index_t t = 0; t < this->numLeaves - k; t++) {
+    index_t node = this->numLeaves + t;
+    parent[find(this->merges[t].left)] = node;
+    parent[find(this->merges[t].right)] = node;
+  }
+
+  std::vector<index_t> labels(this->numLeaves);
+  std::vector<index_t> labelOf(this->nNodes(), this->nNodes());
+  index_t next = 0;
+
+  for (index_t i = 0; i < this->numLeaves; i++) {
+    index_t root = find(i);
+
+    if (labelOf[root] == this->nNodes()) {
+      labelOf[root] = next++;
+    }
+
+    labels[i] = labelOf[root];
+  }
+
+  return labels;
+}
+
+cluster::DistanceMatrix cluster::agg::Dendrogram::cophenetic() const {
+  if (this->merges.size() + 1 < this->numLeaves) {
+    throw std::string(
+      "Cophenetic distances need a dendrogram merged down to one cluster"
+    );
+  }
+
+  cluster::DistanceMatrix distances(this->numLeaves);
+  std::vector<std::vector<index_t>> members(this->nNodes());
+
+  for (index_t i = 0; i < this->numLeaves; i++) {
+    members[i].push_back(i);
+  }
+
+  for (index_t t = 0; t < this->merges.size(); t++) {
+    auto& left = members[this->merges[t].left];
+    auto& right = members[this->merges[t].right];
+
+    for (index_t a : left) {
+      for (index_t b : right) {
+        distances.set(a, b, this->merges[t].height);
+      }
+    }
+
+    auto& node = members[this->numLeaves + t];
+    node.reserve(left.size() + right.size());
+    node.insert(node.end(), left.begin(), left.end());
+    node.insert(node.end(), right.begin(), right.end());
+    left = std::vector<index_t>();
+    right = std::vector<index_t>();
+  }
+
+  return distances;
+}
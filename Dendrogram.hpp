@@ -0,0 +1,49 @@
+#ifndef DENDROGRAM_H
+#define DENDROGRAM_H
+
+#include "ns.hpp"
+
+#include <vector>
+
+// The full merge history of a hierarchical clustering. Leaves are numbered
+// 0..n-1 after the observations; the node created by the t-th merge is
+// numbered n + t.
+class cluster::agg::Dendrogram {
+public:
+  using index_t = cluster::index_t;
+  using data_t = cluster::data_t;
+
+  struct Merge {
+    index_t left;
+    index_t right;
+    data_t height;
+    index_t size;
+  };
+
+private:
+  index_t numLeaves;
+  std::vector<Merge> merges;
+  std::vector<index_t> sizes;
+
+public:
+  // Constructors.
+  Dendrogram(index_t numLeaves = 0);
+
+  // Basic information.
+  index_t nLeaves() const;
+  index_t nNodes() const;
+  index_t size(index_t node) const;
+  const std::vector<Merge>& steps() const;
+
+  // Record a merge of two existing, unmerged nodes. Returns the new node.
+  index_t merge(index_t left, index_t right, data_t height);
+
+  // Labels of the k clusters left after undoing the last merges, numbered
+  // in order of each cluster's first observation.
+  std::vector<index_t> cut(index_t k) const;
+
+  // Height at which each pair of observations first shares a cluster.
+  cluster::DistanceMatrix cophenetic() const;
+};
+
+#endif
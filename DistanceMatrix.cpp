@@ -0,0 +1,70 @@
+#include "ns.hpp"
+#include "DistanceMatrix.hpp"
+
+#include <sstream>
+#include <string>
+#include <utility>
+
+cluster::DistanceMatrix::DistanceMatrix(cluster::DistanceMatrix::index_t n)
+: n(n), values((std::size_t)n * (n > 0 ? n - 1 : 0) / 2) {}
+
+cluster::DistanceMatrix::DistanceMatrix(
+  cluster::DistanceMatrix::index_t n,
+  std::vector<cluster::DistanceMatrix::data_t> condensed
+) : n(n), values(std::move(condensed)) {
+  if (this->values.size() != (std::size_t)n * (n > 0 ? n - 1 : 0) / 2) {
+    std::stringstream s;
+    s << "Expected " << (std::size_t)n * (n > 0 ? n - 1 : 0) / 2
+      << " distances for " << n << " observations; "
+      << "instead found " << this->values.size();
+    throw s.str();
+  }
+}
+
+cluster::DistanceMatrix::index_t cluster::DistanceMatrix::size() const {
+  return this->n;
+}
+
+std::size_t cluster::DistanceMatrix::offset(
+  cluster::DistanceMatrix::index_t i,
+  cluster::DistanceMatrix::index_t j
+) const {
+  if (i > j) {
+    std::swap(i, j);
+  }
+
+  // Rows 0..i-1 hold n-1, n-2, ..., n-i entries before row i starts.
+  return (std::size_t)i * (2 * (std::size_t)this->n - i - 1) / 2 + (j - i - 1);
+}
+
+cluster::DistanceMatrix::data_t cluster::DistanceMatrix::operator () (
+  cluster::DistanceMatrix::index_t i,
+  cluster::DistanceMatrix::index_t j
+) const {
+  return i == j ? 0 : this->values[this->offset(i, j)];
+}
+
+void cluster::DistanceMatrix::set(
+  cluster::DistanceMatrix::index_t i,
+  cluster::DistanceMatrix::index_t j,
+  cluster::DistanceMatrix::data_t value
+) {
+  if (i == j || i >= this->n || j >= this->n) {
+    std::stringstream s;
+    s << "Can't set distance (" << i << ", " << j << ") "
+      << "in a matrix of " << this->n << " observations";
+    throw s.str();
+  }
+
+  this->values[this->offset(i, j)] = value;
+}
+
+const std::vector<cluster::DistanceMatrix::data_t>&
+cluster::DistanceMatrix::condensed() const {
+  return this->values;
+}
+
+std::vector<cluster::DistanceMatrix::data_t>&
+cluster::DistanceMatrix::condensed() {
+  return this->values;
+}
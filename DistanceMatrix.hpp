@@ -0,0 +1,37 @@
+#ifndef DISTANCE_MATRIX_H
+#define DISTANCE_MATRIX_H
+
+#include "ns.hpp"
+
+#include <cstddef>
+#include <vector>
+
+// Symmetric distances between n observations, keeping only the n(n-1)/2
+// entries above the diagonal, row by row.
+class cluster::DistanceMatrix {
+public:
+  using index_t = cluster::index_t;
+  using data_t = cluster::data_t;
+
+private:
+  index_t n;
+  std::vector<data_t> values;
+
+public:
+  // Constructors.
+  DistanceMatrix(index_t n);
+  DistanceMatrix(index_t n, std::vector<data_t> condensed);
+
+  // Basic information.
+  index_t size() const;
+  std::size_t offset(index_t i, index_t j) const;
+
+  // Access entries. The diagonal is always 0 and can't be set.
+  data_t operator () (index_t i, index_t j) const;
+  void set(index_t i, index_t j, data_t value);
+
+  const std::vector<data_t>& condensed() const;
+  std::vector<data_t>& condensed();
+};
+
+#endif
@@ -1,12 +1,16 @@
 #include "ns.hpp"
 #include "Dataset.hpp"
+#include "DistanceMatrix.hpp"
+#include "Exec.hpp"
 
 #include <cmath>
 #include <iostream>
+#include <algorithm>
+#include <utility>
 
 long double cluster::dist::euclidean(
-  std::vector<cluster::data_t> x,
-  std::vector<cluster::data_t> y
+  cluster::span<const cluster::data_t> x,
+  cluster::span<const cluster::data_t> y
 ) {
   long double sum = 0;
 
@@ -22,8 +26,8 @@ long double cluster::dist::euclidean(
 }
 
 long double cluster::dist::manhattan(
-  std::vector<cluster::data_t> x,
-  std::vector<cluster::data_t> y
+  cluster::span<const cluster::data_t> x,
+  cluster::span<const cluster::data_t> y
 ) {
   long double sum = 0;
 
@@ -39,8 +43,8 @@ long double cluster::dist::manhattan(
 }
 
 long double cluster::dist::minkowski(
-  std::vector<cluster::data_t> x,
-  std::vector<cluster::data_t> y
+  cluster::span<const cluster::data_t> x,
+  cluster::span<const cluster::data_t> y
 ) {
   long double sum = 0;
 
@@ -56,8 +60,8 @@ long double cluster::dist::minkowski(
 }
 
 long double cluster::dist::maximum(
-  std::vector<cluster::data_t> x,
-  std::vector<cluster::data_t> y
+  cluster::span<const cluster::data_t> x,
+  cluster::span<const cluster::data_t> y
 ) {
   long double max = 0;
 
@@ -73,8 +77,8 @@ long double cluster::dist::maximum(
 }
 
 long double cluster::dist::canberra(
-  std::vector<cluster::data_t> x,
-  std::vector<cluster::data_t> y
+  cluster::span<const cluster::data_t> x,
+  cluster::span<const cluster::data_t> y
 ) {
   long double sum = 0;
 
@@ -90,3 +94,86 @@ long double cluster::dist::canberra(
 
   return sum;
 }
+
+
+cluster::DistanceMatrix cluster::dist::pairwise(
+  const cluster::Dataset& data,
+  cluster::dist::DistanceMeasure dist,
+  cluster::exec::Policy policy
+) {
+  cluster::index_t n = data.nObs();
+  cluster::DistanceMatrix distances(n);
+  // Rows are read in place where the layout allows it, otherwise gathered
+  // into a pair of buffers per worker.
+  std::vector<std::vector<cluster::data_t>> scratch(
+    2 * (policy == cluster::exec::Policy::threads
+      ? cluster::exec::concurrency()
+      : 1)
+  );
+
+  // Work through square tiles on and above the diagonal so each tile's rows
+  // stay in cache while they're compared against each other.
+  const cluster::index_t tile = 64;
+  cluster::index_t nTiles = (n + tile - 1) / tile;
+  std::vector<std::pair<cluster::index_t, cluster::index_t>> tiles;
+
+  for (cluster::index_t ti = 0; ti < nTiles; ti++) {
+    for (cluster::index_t tj = ti; tj < nTiles; tj++) {
+      tiles.push_back({ti * tile, tj * tile});
+    }
+  }
+
+  auto& values = distances.condensed();
+
+  cluster::exec::parallelFor(
+    tiles.size(),
+    policy,
+    [&](std::size_t begin, std::size_t end, unsigned int worker) {
+      for (std::size_t t = begin; t < end; t++) {
+        cluster::index_t iEnd = std::min(n, tiles[t].first + tile);
+        cluster::index_t jEnd = std::min(n, tiles[t].second + tile);
+
+        for (cluster::index_t i = tiles[t].first; i < iEnd; i++) {
+          cluster::index_t j = std::max(i + 1, tiles[t].second);
+          auto x = data.row(i, scratch[2 * worker]);
+
+          for (; j < jEnd; j++) {
+            values[distances.offset(i, j)] =
+              dist(x, data.row(j, scratch[2 * worker + 1]));
+          }
+        }
+      }
+    },
+    1
+  );
+
+  return distances;
+}
+
+static const std::pair<const char*, cluster::dist::DistanceMeasure*> measures[] = {
+  {"euclidean", cluster::dist::euclidean},
+  {"manhattan", cluster::dist::manhattan},
+  {"minkowski", cluster::dist::minkowski},
+  {"maximum", cluster::dist::maximum},
+  {"canberra", cluster::dist::canberra}
+};
+
+cluster::dist::DistanceMeasure* cluster::dist::byName(const std::string& name) {
+  for (auto& measure : measures) {
+    if (name == measure.first) {
+      return measure.second;
+    }
+  }
+
+  return nullptr;
+}
+
+std::string cluster::dist::nameOf(cluster::dist::DistanceMeasure* dist) {
+  for (auto& measure : measures) {
+    if (dist == measure.second) {
+      return measure.first;
+    }
+  }
+
+  return "";
+}
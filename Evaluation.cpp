@@ -0,0 +1,426 @@
+#include "ns.hpp"
+#include "Dataset.hpp"
+#include "Dendrogram.hpp"
+#include "DistanceMatrix.hpp"
+#include "Exec.hpp"
+#include "Span.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <numeric>
+#include <random>
+#include <sstream>
+
+// Checks that there's one label per observation and at least two clusters,
+// returning the number of clusters.
+static cluster::index_t countClusters(
+  const cluster::eval::Labels& labels,
+  cluster::index_t n
+) {
+  if (labels.size() != n) {
+    std::stringstream s;
+    s << "Expected " << n << " labels; instead found " << labels.size();
+    throw s.str();
+  }
+
+  cluster::index_t k = labels.empty()
+    ? 0
+    : *std::max_element(labels.begin(), labels.end()) + 1;
+
+  if (k < 2) {
+    throw std::string("Evaluating a clustering needs at least two clusters");
+  }
+
+  return k;
+}
+
+static std::vector<cluster::index_t> clusterSizes(
+  const cluster::eval::Labels& labels,
+  cluster::index_t k
+) {
+  std::vector<cluster::index_t> sizes(k);
+
+  for (auto l : labels) {
+    sizes[l]++;
+  }
+
+  return sizes;
+}
+
+// The silhouette width of one observation, given the sum of its distances to
+// the members of each cluster.
+static cluster::data_t silhouetteWidth(
+  const cluster::data_t* sums,
+  const std::vector<cluster::index_t>& sizes,
+  cluster::index_t own
+) {
+  if (sizes[own] <= 1) {
+    return 0;
+  }
+
+  cluster::data_t a = sums[own] / (sizes[own] - 1);
+  cluster::data_t b = std::numeric_limits<cluster::data_t>::max();
+
+  for (cluster::index_t c = 0; c < sizes.size(); c++) {
+    if (c != own && sizes[c] > 0) {
+      b = std::min(b, sums[c] / sizes[c]);
+    }
+  }
+
+  cluster::data_t scale = std::max(a, b);
+  return scale > 0 ? (b - a) / scale : 0;
+}
+
+// How many workers parallelFor() may use under policy, for per-worker
+// scratch space and partial results.
+static std::size_t workers(cluster::exec::Policy policy) {
+  return policy == cluster::exec::Policy::threads
+    ? cluster::exec::concurrency()
+    : 1;
+}
+
+std::vector<cluster::data_t> cluster::eval::silhouettes(
+  const cluster::Dataset& data,
+  const cluster::eval::Labels& labels,
+  cluster::dist::DistanceMeasure dist,
+  cluster::exec::Policy policy
+) {
+  cluster::index_t n = data.nObs();
+  cluster::index_t k = countClusters(labels, n);
+  auto sizes = clusterSizes(labels, k);
+  std::vector<cluster::data_t> widths(n);
+  std::vector<std::vector<cluster::data_t>> scratch(2 * workers(policy));
+
+  // Each task takes a block of observations and sweeps the data a block at a
+  // time, so both blocks of rows stay in cache while they're compared.
+  const cluster::index_t block = 64;
+
+  cluster::exec::parallelFor(
+    (n + block - 1) / block,
+    policy,
+    [&](std::size_t begin, std::size_t end, unsigned int worker) {
+      std::vector<cluster::data_t> sums((std::size_t)block * k);
+
+      for (std::size_t b = begin; b < end; b++) {
+        cluster::index_t i0 = b * block;
+        cluster::index_t i1 = std::min(n, i0 + block);
+        std::fill(sums.begin(), sums.end(), 0);
+
+        for (cluster::index_t j0 = 0; j0 < n; j0 += block) {
+          cluster::index_t j1 = std::min(n, j0 + block);
+
+          for (cluster::index_t i = i0; i < i1; i++) {
+            cluster::data_t* row = &sums[(std::size_t)(i - i0) * k];
+            auto x = data.row(i, scratch[2 * worker]);
+
+            for (cluster::index_t j = j0; j < j1; j++) {
+              if (i != j) {
+                row[labels[j]] +=
+                  dist(x, data.row(j, scratch[2 * worker + 1]));
+              }
+            }
+          }
+        }
+
+        for (cluster::index_t i = i0; i < i1; i++) {
+          widths[i] = silhouetteWidth(
+            &sums[(std::size_t)(i - i0) * k], sizes, labels[i]
+          );
+        }
+      }
+    },
+    1
+  );
+
+  return widths;
+}
+
+std::vector<cluster::data_t> cluster::eval::silhouettes(
+  const cluster::DistanceMatrix& distances,
+  const cluster::eval::Labels& labels,
+  cluster::exec::Policy policy
+) {
+  cluster::index_t n = distances.size();
+  cluster::index_t k = countClusters(labels, n);
+  auto sizes = clusterSizes(labels, k);
+  std::vector<cluster::data_t> widths(n);
+
+  cluster::exec::parallelFor(
+    n,
+    policy,
+    [&](std::size_t begin, std::size_t end, unsigned int) {
+      std::vector<cluster::data_t> sums(k);
+
+      for (cluster::index_t i = begin; i < end; i++) {
+        std::fill(sums.begin(), sums.end(), 0);
+
+        for (cluster::index_t j = 0; j < n; j++) {
+          sums[labels[j]] += distances(i, j);
+        }
+
+        widths[i] = silhouetteWidth(sums.data(), sizes, labels[i]);
+      }
+    }
+  );
+
+  return widths;
+}
+
+cluster::data_t cluster::eval::silhouette(
+  const cluster::Dataset& data,
+  const cluster::eval::Labels& labels,
+  cluster::dist::DistanceMeasure dist,
+  cluster::exec::Policy policy
+) {
+  return cluster::stat::mean(
+    cluster::eval::silhouettes(data, labels, dist, policy)
+  );
+}
+
+cluster::data_t cluster::eval::silhouette(
+  const cluster::DistanceMatrix& distances,
+  const cluster::eval::Labels& labels,
+  cluster::exec::Policy policy
+) {
+  return cluster::stat::mean(
+    cluster::eval::silhouettes(distances, labels, policy)
+  );
+}
+
+cluster::data_t cluster::eval::sampledSilhouette(
+  const cluster::Dataset& data,
+  const cluster::eval::Labels& labels,
+  cluster::index_t sampleSize,
+  unsigned int seed,
+  cluster::dist::DistanceMeasure dist,
+  cluster::exec::Policy policy
+) {
+  if (sampleSize == 0) {
+    throw std::string("A sampled silhouette needs a sample of at least one");
+  }
+
+  cluster::index_t n = data.nObs();
+  cluster::index_t k = countClusters(labels, n);
+  auto sizes = clusterSizes(labels, k);
+  std::vector<std::vector<cluster::data_t>> scratch(2 * workers(policy));
+
+  // Draw the sample with a partial Fisher-Yates shuffle.
+  sampleSize = std::min(sampleSize, n);
+  std::vector<cluster::index_t> order(n);
+  std::iota(order.begin(), order.end(), 0);
+  std::mt19937 random(seed);
+
+  for (cluster::index_t s = 0; s < sampleSize; s++) {
+    std::uniform_int_distribution<cluster::index_t> pick(s, n - 1);
+    std::swap(order[s], order[pick(random)]);
+  }
+
+  std::vector<cluster::data_t> widths(sampleSize);
+
+  cluster::exec::parallelFor(
+    sampleSize,
+    policy,
+    [&](std::size_t begin, std::size_t end, unsigned int worker) {
+      std::vector<cluster::data_t> sums(k);
+
+      for (std::size_t s = begin; s < end; s++) {
+        cluster::index_t i = order[s];
+        auto x = data.row(i, scratch[2 * worker]);
+        std::fill(sums.begin(), sums.end(), 0);
+
+        for (cluster::index_t j = 0; j < n; j++) {
+          if (i != j) {
+            sums[labels[j]] += dist(x, data.row(j, scratch[2 * worker + 1]));
+          }
+        }
+
+        widths[s] = silhouetteWidth(sums.data(), sizes, labels[i]);
+      }
+    }
+  );
+
+  return cluster::stat::mean(widths);
+}
+
+// Sums each cluster's observations in per-worker partials, then divides by
+// the cluster sizes.
+static std::vector<std::vector<cluster::data_t>> centroids(
+  const cluster::Dataset& data,
+  const cluster::eval::Labels& labels,
+  const std::vector<cluster::index_t>& sizes,
+  cluster::exec::Policy policy
+) {
+  cluster::index_t k = sizes.size();
+  cluster::index_t nVars = data.nVars();
+  std::vector<std::vector<cluster::data_t>> scratch(workers(policy));
+  std::vector<std::vector<std::vector<cluster::data_t>>> partials(
+    workers(policy),
+    std::vector<std::vector<cluster::data_t>>(
+      k, std::vector<cluster::data_t>(nVars)
+    )
+  );
+
+  cluster::exec::parallelFor(
+    data.nObs(),
+    policy,
+    [&](std::size_t begin, std::size_t end, unsigned int worker) {
+      for (std::size_t i = begin; i < end; i++) {
+        auto& sum = partials[worker][labels[i]];
+        auto row = data.row(i, scratch[worker]);
+
+        for (cluster::index_t v = 0; v < nVars; v++) {
+          sum[v] += row[v];
+        }
+      }
+    }
+  );
+
+  auto means = partials[0];
+
+  for (cluster::index_t c = 0; c < k; c++) {
+    for (cluster::index_t v = 0; v < nVars; v++) {
+      for (std::size_t w = 1; w < partials.size(); w++) {
+        means[c][v] += partials[w][c][v];
+      }
+
+      means[c][v] /= std::max<cluster::index_t>(sizes[c], 1);
+    }
+  }
+
+  return means;
+}
+
+cluster::data_t cluster::eval::calinskiHarabasz(
+  const cluster::Dataset& data,
+  const cluster::eval::Labels& labels,
+  cluster::exec::Policy policy
+) {
+  cluster::index_t n = data.nObs();
+  cluster::index_t k = countClusters(labels, n);
+
+  if (n <= k) {
+    throw std::string("Calinski-Harabasz needs more observations than clusters");
+  }
+
+  auto sizes = clusterSizes(labels, k);
+  auto means = centroids(data, labels, sizes, policy);
+  auto grand = data.applyCol(cluster::stat::mean, policy);
+
+  // Between-cluster dispersion.
+  cluster::data_t between = 0;
+
+  for (cluster::index_t c = 0; c < k; c++) {
+    for (cluster::index_t v = 0; v < data.nVars(); v++) {
+      between += sizes[c] * std::pow(means[c][v] - grand[v], 2);
+    }
+  }
+
+  // Within-cluster dispersion.
+  std::vector<cluster::data_t> within(workers(policy));
+  std::vector<std::vector<cluster::data_t>> scratch(workers(policy));
+
+  cluster::exec::parallelFor(
+    n,
+    policy,
+    [&](std::size_t begin, std::size_t end, unsigned int worker) {
+      for (std::size_t i = begin; i < end; i++) {
+        auto row = data.row(i, scratch[worker]);
+
+        for (cluster::index_t v = 0; v < data.nVars(); v++) {
+          within[worker] += std::pow(row[v] - means[labels[i]][v], 2);
+        }
+      }
+    }
+  );
+
+  cluster::data_t w = std::accumulate(within.begin(), within.end(),
+    cluster::data_t(0));
+
+  return w > 0
+    ? (between / (k - 1)) / (w / (n - k))
+    : std::numeric_limits<cluster::data_t>::infinity();
+}
+
+cluster::data_t cluster::eval::daviesBouldin(
+  const cluster::Dataset& data,
+  const cluster::eval::Labels& labels,
+  cluster::dist::DistanceMeasure dist,
+  cluster::exec::Policy policy
+) {
+  cluster::index_t n = data.nObs();
+  cluster::index_t k = countClusters(labels, n);
+  auto sizes = clusterSizes(labels, k);
+  auto means = centroids(data, labels, sizes, policy);
+
+  // Average distance from each cluster's members to its centroid.
+  std::vector<std::vector<cluster::data_t>> partials(
+    workers(policy),
+    std::vector<cluster::data_t>(k)
+  );
+  std::vector<std::vector<cluster::data_t>> scratch(workers(policy));
+
+  cluster::exec::parallelFor(
+    n,
+    policy,
+    [&](std::size_t begin, std::size_t end, unsigned int worker) {
+      for (std::size_t i = begin; i < end; i++) {
+        partials[worker][labels[i]] +=
+          dist(data.row(i, scratch[worker]), means[labels[i]]);
+      }
+    }
+  );
+
+  std::vector<cluster::data_t> scatter(k);
+
+  for (cluster::index_t c = 0; c < k; c++) {
+    for (auto& partial : partials) {
+      scatter[c] += partial[c];
+    }
+
+    scatter[c] /= std::max<cluster::index_t>(sizes[c], 1);
+  }
+
+  // Each cluster's worst ratio of combined scatter to centroid separation.
+  cluster::data_t sum = 0;
+  cluster::index_t nonEmpty = 0;
+
+  for (cluster::index_t c = 0; c < k; c++) {
+    if (sizes[c] == 0) continue;
+
+    cluster::data_t worst = 0;
+
+    for (cluster::index_t o = 0; o < k; o++) {
+      if (o == c || sizes[o] == 0) continue;
+
+      cluster::data_t separation = dist(means[c], means[o]);
+      worst = std::max(worst, separation > 0
+        ? (scatter[c] + scatter[o]) / separation
+        : std::numeric_limits<cluster::data_t>::infinity());
+    }
+
+    sum += worst;
+    nonEmpty++;
+  }
+
+  return sum / nonEmpty;
+}
+
+cluster::data_t cluster::eval::copheneticCorrelation(
+  const cluster::agg::Dendrogram& tree,
+  const cluster::DistanceMatrix& distances
+) {
+  if (tree.nLeaves() != distances.size()) {
+    std::stringstream s;
+    s << "Dendrogram has " << tree.nLeaves() << " leaves but the distance "
+      << "matrix has " << distances.size() << " observations";
+    throw s.str();
+  }
+
+  cluster::DistanceMatrix heights = tree.cophenetic();
+  const auto& x = heights.condensed();
+  const auto& y = distances.condensed();
+
+  return cluster::stat::cov(x, y) /
+    (cluster::stat::sd(x) * cluster::stat::sd(y));
+}
@@ -0,0 +1,19 @@
+#include "ns.hpp"
+#include "Exec.hpp"
+
+#include <thread>
+
+static unsigned int configuredThreads = 0;
+
+unsigned int cluster::exec::concurrency() {
+  if (configuredThreads > 0) {
+    return configuredThreads;
+  }
+
+  // hardware_concurrency() may report 0 when it can't tell.
+  return std::max(1u, std::thread::hardware_concurrency());
+}
+
+void cluster::exec::setConcurrency(unsigned int threads) {
+  configuredThreads = threads;
+}
@@ -0,0 +1,82 @@
+#ifndef EXEC_H
+#define EXEC_H
+
+#include "ns.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace cluster {
+  namespace exec {
+    template <class F>
+    void parallelFor(std::size_t n, Policy policy, F f, std::size_t grain = 0);
+  }
+}
+
+// Calls f(begin, end, worker) over chunks of [0, n). Under Policy::threads
+// the chunks are handed out dynamically to up to concurrency() workers, so
+// uneven chunks (like the rows of a triangle) still balance. Worker ids are
+// dense, so callers can keep per-worker scratch space. The first exception
+// thrown by any worker is rethrown once all of them have stopped.
+template <class F>
+void cluster::exec::parallelFor(
+  std::size_t n,
+  cluster::exec::Policy policy,
+  F f,
+  std::size_t grain
+) {
+  std::size_t nThreads = policy == cluster::exec::Policy::threads
+    ? std::min<std::size_t>(cluster::exec::concurrency(), n)
+    : 1;
+
+  if (nThreads <= 1) {
+    if (n > 0) f(std::size_t(0), n, 0u);
+    return;
+  }
+
+  if (grain == 0) {
+    grain = std::max<std::size_t>(1, n / (nThreads * 8));
+  }
+
+  std::atomic<std::size_t> next(0);
+  std::atomic<bool> failed(false);
+  std::exception_ptr error;
+  std::mutex errorLock;
+
+  auto work = [&](unsigned int worker) {
+    try {
+      while (!failed) {
+        std::size_t begin = next.fetch_add(grain);
+        if (begin >= n) break;
+        f(begin, std::min(n, begin + grain), worker);
+      }
+    } catch (...) {
+      std::lock_guard<std::mutex> lock(errorLock);
+      if (!error) error = std::current_exception();
+      failed = true;
+    }
+  };
+
+  std::vector<std::thread> pool;
+
+  for (unsigned int w = 1; w < nThreads; w++) {
+    pool.emplace_back(work, w);
+  }
+
+  work(0);
+
+  for (auto& t : pool) {
+    t.join();
+  }
+
+  if (error) {
+    std::rethrow_exception(error);
+  }
+}
+
+#endif
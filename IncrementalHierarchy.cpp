@@ -0,0 +1,258 @@
+#include "ns.hpp"
+#include "Dataset.hpp"
+#include "Dendrogram.hpp"
+#include "IncrementalHierarchy.hpp"
+
+#include <algorithm>
+#include <queue>
+#include <sstream>
+#include <utility>
+
+cluster::agg::IncrementalHierarchy::IncrementalHierarchy(
+  const cluster::Dataset& data,
+  const cluster::agg::Dendrogram& tree,
+  cluster::dist::DistanceMeasure dist,
+  cluster::agg::Linkage linkage,
+  cluster::agg::IncrementalHierarchy::data_t maxGrowth
+) : data(data), dist(dist), builtWeight(data.totalWeight()),
+    insertedWeight(0), maxGrowth(maxGrowth), totalInversions(0) {
+  index_t n = data.nObs();
+
+  if (linkage != cluster::agg::lCentroid) {
+    throw std::string("Incremental hierarchies need a tree built with ") +
+      "centroid linkage";
+  }
+
+  if (tree.nLeaves() != n || (n > 0 && tree.steps().size() + 1 != n)) {
+    std::stringstream s;
+    s << "Expected a dendrogram of " << n << " observations merged down to "
+      << "one cluster";
+    throw s.str();
+  }
+
+  // Leaves, then the merges in order, so children always come first.
+  for (index_t i = 0; i < n; i++) {
+    this->nodes.push_back({none, none, none, 0, data.weight(i), data[i], {i}});
+  }
+
+  for (const auto& merge : tree.steps()) {
+    Node& l = this->nodes[merge.left];
+    Node& r = this->nodes[merge.right];
+    Node node = {none, merge.left, merge.right, merge.height,
+      l.weight + r.weight, l.centroid, {}};
+
+    for (index_t v = 0; v < node.centroid.size(); v++) {
+      node.centroid[v] =
+        (l.weight * l.centroid[v] + r.weight * r.centroid[v]) / node.weight;
+    }
+
+    l.parent = r.parent = this->nodes.size();
+    this->nodes.push_back(node);
+  }
+
+  this->root = n > 0 ? this->nodes.size() - 1 : none;
+}
+
+cluster::agg::IncrementalHierarchy::index_t
+cluster::agg::IncrementalHierarchy::nObs() const {
+  return this->data.nObs();
+}
+
+const cluster::Dataset& cluster::agg::IncrementalHierarchy::dataset() const {
+  return this->data;
+}
+
+bool cluster::agg::IncrementalHierarchy::needsRebuild() const {
+  return this->totalInversions > 0 ||
+    this->insertedWeight > this->maxGrowth * this->builtWeight;
+}
+
+void cluster::agg::IncrementalHierarchy::addToPath(
+  index_t node,
+  const std::vector<data_t>& row,
+  data_t weight
+) {
+  for (; node != none; node = this->nodes[node].parent) {
+    Node& n = this->nodes[node];
+    data_t total = n.weight + weight;
+
+    for (index_t v = 0; v < row.size(); v++) {
+      n.centroid[v] = (n.weight * n.centroid[v] + weight * row[v]) / total;
+    }
+
+    n.weight = total;
+  }
+}
+
+cluster::agg::IncrementalHierarchy::InsertReport
+cluster::agg::IncrementalHierarchy::insert(
+  const cluster::Dataset& rows,
+  data_t threshold
+) {
+  if (rows.nVars() != this->data.nVars()) {
+    std::stringstream s;
+    s << "Expected rows with " << this->data.nVars() << " variables; "
+      << "instead found " << rows.nVars();
+    throw s.str();
+  }
+
+  InsertReport report = {0, 0, 0, false};
+
+  for (index_t i = 0; i < rows.nObs(); i++) {
+    auto row = rows[i];
+    data_t weight = rows.weight(i);
+    index_t obs = this->data.nObs();
+    this->data.add(row, weight);
+    this->insertedWeight += weight;
+
+    // Walk down towards the nearer child for as long as the row lies within
+    // that child's own merge height. v ends up as the node to insert under
+    // and c as the child the row is closest to.
+    index_t v = none;
+    index_t c = this->root;
+    data_t dc = c == none ? 0 : this->dist(row, this->nodes[c].centroid);
+
+    while (c != none && this->nodes[c].left != none && dc <= this->nodes[c].height) {
+      const Node& n = this->nodes[c];
+      data_t dl = this->dist(row, this->nodes[n.left].centroid);
+      data_t dr = this->dist(row, this->nodes[n.right].centroid);
+      v = c;
+      c = dl <= dr ? n.left : n.right;
+      dc = std::min(dl, dr);
+    }
+
+    if (c == none) {
+      // The hierarchy was empty; the row becomes its root.
+      this->nodes.push_back({none, none, none, 0, weight, row, {obs}});
+      this->root = this->nodes.size() - 1;
+      report.grafted++;
+    } else if (dc <= threshold) {
+      this->nodes[c].members.push_back(obs);
+      this->addToPath(c, row, weight);
+      report.absorbed++;
+    } else {
+      // Pair the row with c under a new node, which takes c's place.
+      index_t leaf = this->nodes.size();
+      index_t joined = leaf + 1;
+      this->nodes.push_back({joined, none, none, 0, weight, row, {obs}});
+      this->nodes.push_back({v, c, leaf, dc, this->nodes[c].weight,
+        this->nodes[c].centroid, {}});
+      this->nodes[c].parent = joined;
+
+      if (v == none) {
+        this->root = joined;
+      } else if (this->nodes[v].left == c) {
+        this->nodes[v].left = joined;
+      } else {
+        this->nodes[v].right = joined;
+      }
+
+      this->addToPath(joined, row, weight);
+      report.grafted++;
+
+      if (v != none && dc > this->nodes[v].height) {
+        report.inversions++;
+        this->totalInversions++;
+      }
+    }
+  }
+
+  report.rebuild = this->needsRebuild();
+  return report;
+}
+
+// Follows the nearer child down from node until reaching one of the parts.
+cluster::agg::IncrementalHierarchy::index_t
+cluster::agg::IncrementalHierarchy::partOf(
+  index_t node,
+  const std::vector<index_t>& part
+) const {
+  for (index_t up = node; up != none; up = this->nodes[up].parent) {
+    if (part[up] != none) {
+      return part[up];
+    }
+  }
+
+  // node sits above the cut, so hand its members to the nearer child.
+  const auto& centroid = this->nodes[node].centroid;
+
+  while (part[node] == none) {
+    const Node& n = this->nodes[node];
+    node = this->dist(centroid, this->nodes[n.left].centroid) <=
+      this->dist(centroid, this->nodes[n.right].centroid)
+      ? n.left
+      : n.right;
+  }
+
+  return part[node];
+}
+
+std::vector<cluster::agg::IncrementalHierarchy::index_t>
+cluster::agg::IncrementalHierarchy::cut(index_t k) const {
+  index_t nLeaves = 0;
+
+  for (const auto& node : this->nodes) {
+    nLeaves += node.left == none;
+  }
+
+  if (k == 0 || k > nLeaves) {
+    std::stringstream s;
+    s << "Can't cut a hierarchy of " << nLeaves << " leaves into " << k
+      << " clusters";
+    throw s.str();
+  }
+
+  // Split the highest remaining node until there are k parts. Leaves sit at
+  // height 0 like merges of duplicate rows, so ties go to internal nodes to
+  // make sure a leaf is never picked for splitting.
+  auto lower = [&](index_t a, index_t b) {
+    const Node& x = this->nodes[a];
+    const Node& y = this->nodes[b];
+    return x.height != y.height
+      ? x.height < y.height
+      : x.left == none && y.left != none;
+  };
+  std::priority_queue<index_t, std::vector<index_t>, decltype(lower)> parts(
+    lower
+  );
+  parts.push(this->root);
+
+  while (parts.size() < k) {
+    const Node& top = this->nodes[parts.top()];
+    parts.pop();
+    parts.push(top.left);
+    parts.push(top.right);
+  }
+
+  std::vector<index_t> part(this->nodes.size(), none);
+
+  for (index_t p = 0; !parts.empty(); p++, parts.pop()) {
+    part[parts.top()] = p;
+  }
+
+  // Label observations, renumbering parts by their first observation.
+  std::vector<index_t> labels(this->data.nObs());
+  std::vector<index_t> renumber(k, none);
+  std::vector<index_t> raw(this->data.nObs());
+  index_t next = 0;
+
+  for (index_t node = 0; node < this->nodes.size(); node++) {
+    if (this->nodes[node].members.empty()) continue;
+
+    index_t p = this->partOf(node, part);
+
+    for (index_t obs : this->nodes[node].members) {
+      raw[obs] = p;
+    }
+  }
+
+  for (index_t obs = 0; obs < raw.size(); obs++) {
+    if (renumber[raw[obs]] == none) {
+      renumber[raw[obs]] = next++;
+    }
+
+    labels[obs] = renumber[raw[obs]];
+  }
+
+  return labels;
+}
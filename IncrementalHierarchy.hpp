@@ -0,0 +1,84 @@
+#ifndef INCREMENTAL_HIERARCHY_H
+#define INCREMENTAL_HIERARCHY_H
+
+#include "ns.hpp"
+#include "Dataset.hpp"
+
+#include <vector>
+
+// A hierarchy that new observations can be added to without reclustering.
+// Every node caches its (weighted) centroid and total weight, so inserting a
+// row only touches the nodes on its path from the root.
+class cluster::agg::IncrementalHierarchy {
+public:
+  using index_t = cluster::index_t;
+  using data_t = cluster::data_t;
+
+  struct InsertReport {
+    // Rows that fell within the threshold of an existing cluster and joined
+    // it without changing the tree's shape.
+    index_t absorbed;
+    // Rows that were grafted into the tree as new leaves.
+    index_t grafted;
+    // Grafts that ended up higher than the node above them.
+    index_t inversions;
+    // Whether the tree has drifted far enough that it should be rebuilt.
+    bool rebuild;
+  };
+
+private:
+  static constexpr index_t none = -1;
+
+  struct Node {
+    index_t parent;
+    index_t left;
+    index_t right;
+    data_t height;
+    data_t weight;
+    std::vector<data_t> centroid;
+    // Observations attached directly to this node.
+    std::vector<index_t> members;
+  };
+
+  cluster::Dataset data;
+  cluster::dist::DistanceMeasure* dist;
+  std::vector<Node> nodes;
+  index_t root;
+  data_t builtWeight;
+  data_t insertedWeight;
+  data_t maxGrowth;
+  index_t totalInversions;
+
+  void addToPath(index_t node, const std::vector<data_t>& row, data_t weight);
+  index_t partOf(index_t node, const std::vector<index_t>& part) const;
+
+public:
+  // Constructors. tree must have been built from data with dist and the
+  // given linkage, which has to be lCentroid: inserts compare a row's
+  // distance to a node's centroid against its merge height, and only centroid
+  // linkage makes those the same kind of number. maxGrowth is how much
+  // weight, relative to the original data, can be inserted before a rebuild
+  // is recommended.
+  IncrementalHierarchy(
+    const cluster::Dataset& data,
+    const cluster::agg::Dendrogram& tree,
+    cluster::dist::DistanceMeasure dist,
+    cluster::agg::Linkage linkage,
+    data_t maxGrowth = 0.5
+  );
+
+  // Basic information.
+  index_t nObs() const;
+  const cluster::Dataset& dataset() const;
+  bool needsRebuild() const;
+
+  // Insert new observations. Rows within threshold of the nearest cluster
+  // on their way down the tree join it; the rest become new leaves.
+  InsertReport insert(const cluster::Dataset& rows, data_t threshold = 0);
+
+  // Labels of every observation, original and inserted, after splitting the
+  // k - 1 highest nodes. Numbered like Dendrogram::cut().
+  std::vector<index_t> cut(index_t k) const;
+};
+
+#endif
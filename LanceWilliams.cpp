@@ -0,0 +1,238 @@
+#include "ns.hpp"
+#include "Dendrogram.hpp"
+#include "DistanceMatrix.hpp"
+#include "Exec.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <numeric>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace {
+  enum class Method { single, complete, average, centroid, ward };
+
+  const cluster::index_t none = -1;
+}
+
+static Method methodOf(cluster::agg::Linkage linkage) {
+  if (linkage == cluster::agg::lSingle) return Method::single;
+  if (linkage == cluster::agg::lComplete) return Method::complete;
+  if (linkage == cluster::agg::lAverage) return Method::average;
+  if (linkage == cluster::agg::lCentroid) return Method::centroid;
+  if (linkage == cluster::agg::lWards) return Method::ward;
+
+  throw std::string(
+    "Only the built-in linkages can be merged with Lance-Williams updates"
+  );
+}
+
+// The distance from cluster k to the union of clusters i and j.
+static cluster::data_t update(
+  Method method,
+  cluster::data_t dik,
+  cluster::data_t djk,
+  cluster::data_t dij,
+  cluster::data_t ni,
+  cluster::data_t nj,
+  cluster::data_t nk
+) {
+  switch (method) {
+    case Method::single:
+      return std::min(dik, djk);
+    case Method::complete:
+      return std::max(dik, djk);
+    case Method::average:
+      return (ni * dik + nj * djk) / (ni + nj);
+    case Method::centroid:
+      return (ni * dik + nj * djk) / (ni + nj) -
+        ni * nj * dij / ((ni + nj) * (ni + nj));
+    case Method::ward:
+      return ((ni + nk) * dik + (nj + nk) * djk - nk * dij) / (ni + nj + nk);
+  }
+
+  return 0;
+}
+
+// Merges clusters starting out with the given sizes, which are the rows'
+// weights, or all 1 for unweighted data.
+static cluster::agg::Dendrogram merge(
+  cluster::DistanceMatrix& distances,
+  std::vector<cluster::data_t> size,
+  bool weighted,
+  Method method,
+  cluster::exec::Policy policy
+) {
+  cluster::index_t n = distances.size();
+  auto& d = distances.condensed();
+
+  // Centroid and Ward's updates hold for squared euclidean distances. Ward's
+  // are scaled by n1 n2 / (n1 + n2) so heights match lWards(), which for
+  // single rows of weight 1 is halving them.
+  if (method == Method::centroid || (method == Method::ward && !weighted)) {
+    for (auto& v : d) {
+      v = method == Method::ward ? v * v / 2 : v * v;
+    }
+  } else if (method == Method::ward) {
+    for (cluster::index_t i = 0; i < n; i++) {
+      for (cluster::index_t j = i + 1; j < n; j++) {
+        auto& v = d[distances.offset(i, j)];
+        v = size[i] * size[j] / (size[i] + size[j]) * v * v;
+      }
+    }
+  }
+
+  std::vector<char> active(n, 1);
+  std::vector<cluster::index_t> id(n);
+  std::iota(id.begin(), id.end(), 0);
+
+  // Each row's nearest active cluster after it, ties going to the first.
+  std::vector<cluster::index_t> nn(n, none);
+  std::vector<cluster::data_t> nnDist(
+    n, std::numeric_limits<cluster::data_t>::max()
+  );
+
+  auto findNearest = [&](cluster::index_t i) {
+    nn[i] = none;
+    nnDist[i] = std::numeric_limits<cluster::data_t>::max();
+
+    for (cluster::index_t j = i + 1; j < n; j++) {
+      if (active[j] && d[distances.offset(i, j)] < nnDist[i]) {
+        nnDist[i] = d[distances.offset(i, j)];
+        nn[i] = j;
+      }
+    }
+  };
+
+  cluster::exec::parallelFor(
+    n,
+    policy,
+    [&](std::size_t begin, std::size_t end, unsigned int) {
+      for (std::size_t i = begin; i < end; i++) findNearest(i);
+    }
+  );
+
+  cluster::agg::Dendrogram tree(n);
+  std::vector<cluster::index_t> best(
+    policy == cluster::exec::Policy::threads ? cluster::exec::concurrency() : 1
+  );
+
+  for (cluster::index_t step = 0; step + 1 < n; step++) {
+    // Determine which two clusters are closest.
+    std::fill(best.begin(), best.end(), none);
+
+    cluster::exec::parallelFor(
+      n,
+      policy,
+      [&](std::size_t begin, std::size_t end, unsigned int worker) {
+        cluster::index_t& b = best[worker];
+
+        for (cluster::index_t k = begin; k < end; k++) {
+          if (
+            active[k] && nn[k] != none &&
+            (b == none || nnDist[k] < nnDist[b] ||
+              (nnDist[k] == nnDist[b] && k < b))
+          ) {
+            b = k;
+          }
+        }
+      }
+    );
+
+    cluster::index_t i = none;
+
+    for (cluster::index_t b : best) {
+      if (
+        b != none &&
+        (i == none || nnDist[b] < nnDist[i] ||
+          (nnDist[b] == nnDist[i] && b < i))
+      ) {
+        i = b;
+      }
+    }
+
+    cluster::index_t j = nn[i];
+    cluster::data_t dij = nnDist[i];
+
+    // Merge j into i's slot and update i's distances to everything else.
+    id[i] = tree.merge(
+      id[i],
+      id[j],
+      method == Method::centroid ? std::sqrt(dij) : dij
+    );
+    active[j] = 0;
+
+    cluster::exec::parallelFor(
+      n,
+      policy,
+      [&](std::size_t begin, std::size_t end, unsigned int) {
+        for (cluster::index_t k = begin; k < end; k++) {
+          if (!active[k] || k == i) continue;
+
+          auto& dik = d[distances.offset(i, k)];
+          dik = update(method, dik, d[distances.offset(j, k)], dij,
+            size[i], size[j], size[k]);
+        }
+      }
+    );
+
+    size[i] += size[j];
+    nn[j] = none;
+
+    // Rows pointing at i or j need a rescan; rows before i just compare
+    // their cached minimum with the new distance to i.
+    cluster::exec::parallelFor(
+      n,
+      policy,
+      [&](std::size_t begin, std::size_t end, unsigned int) {
+        for (cluster::index_t k = begin; k < end; k++) {
+          if (!active[k]) continue;
+
+          if (k == i || nn[k] == i || nn[k] == j) {
+            findNearest(k);
+          } else if (k < i) {
+            cluster::data_t dki = d[distances.offset(k, i)];
+
+            if (dki < nnDist[k] || (dki == nnDist[k] && i < nn[k])) {
+              nnDist[k] = dki;
+              nn[k] = i;
+            }
+          }
+        }
+      }
+    );
+  }
+
+  return tree;
+}
+
+cluster::agg::Dendrogram cluster::agg::lanceWilliams(
+  cluster::DistanceMatrix distances,
+  cluster::agg::Linkage linkage,
+  cluster::exec::Policy policy
+) {
+  Method method = methodOf(linkage);
+  std::vector<cluster::data_t> size(distances.size(), 1);
+  return merge(distances, std::move(size), false, method, policy);
+}
+
+cluster::agg::Dendrogram cluster::agg::lanceWilliams(
+  cluster::DistanceMatrix distances,
+  const std::vector<cluster::data_t>& weights,
+  cluster::agg::Linkage linkage,
+  cluster::exec::Policy policy
+) {
+  Method method = methodOf(linkage);
+
+  if (weights.size() != distances.size()) {
+    std::stringstream s;
+    s << "Expected " << distances.size() << " weights; instead found "
+      << weights.size();
+    throw s.str();
+  }
+
+  return merge(distances, weights, true, method, policy);
+}
@@ -0,0 +1,147 @@
+#include "ns.hpp"
+#include "Dataset.hpp"
+#include "Exec.hpp"
+#include "Mahalanobis.hpp"
+
+#include <cmath>
+#include <sstream>
+
+cluster::dist::Mahalanobis::Mahalanobis(
+  const cluster::Dataset& reference,
+  cluster::exec::Policy policy
+) : d(reference.nVars()),
+    factor(cluster::stat::covariance(reference, policy)) {
+  // Cholesky factorization in place, a column at a time; the entries below
+  // each diagonal only depend on earlier columns, so they run in parallel.
+  auto at = [&](index_t r, index_t c) -> data_t& {
+    return this->factor[(std::size_t)r * this->d + c];
+  };
+
+  for (index_t j = 0; j < this->d; j++) {
+    data_t diag = at(j, j);
+
+    for (index_t k = 0; k < j; k++) {
+      diag -= at(j, k) * at(j, k);
+    }
+
+    if (!(diag > 0)) {
+      std::stringstream s;
+      s << "Covariance matrix isn't positive definite (variable " << j
+        << " is a combination of earlier ones)";
+      throw s.str();
+    }
+
+    at(j, j) = std::sqrt(diag);
+
+    // Early columns are too cheap to be worth handing out.
+    std::size_t work = (std::size_t)(this->d - j - 1) * j;
+
+    cluster::exec::parallelFor(
+      this->d - j - 1,
+      work < (1 << 14) ? cluster::exec::Policy::serial : policy,
+      [&](std::size_t begin, std::size_t end, unsigned int) {
+        for (index_t i = j + 1 + begin; i < j + 1 + end; i++) {
+          data_t sum = at(i, j);
+
+          for (index_t k = 0; k < j; k++) {
+            sum -= at(i, k) * at(j, k);
+          }
+
+          at(i, j) = sum / at(j, j);
+        }
+      }
+    );
+  }
+
+  // Clear the upper triangle so the factor reads as what it is.
+  for (index_t r = 0; r < this->d; r++) {
+    for (index_t c = r + 1; c < this->d; c++) {
+      at(r, c) = 0;
+    }
+  }
+}
+
+cluster::dist::Mahalanobis::index_t cluster::dist::Mahalanobis::nVars() const {
+  return this->d;
+}
+
+// Forward substitution: x becomes L^-1 x.
+void cluster::dist::Mahalanobis::solve(std::vector<data_t>& x) const {
+  if (x.size() != this->d) {
+    std::stringstream s;
+    s << "Expected " << this->d << " entries in data entry; "
+      << "instead found " << x.size();
+    throw s.str();
+  }
+
+  for (index_t r = 0; r < this->d; r++) {
+    const data_t* row = &this->factor[(std::size_t)r * this->d];
+    data_t sum = x[r];
+
+    for (index_t c = 0; c < r; c++) {
+      sum -= row[c] * x[c];
+    }
+
+    x[r] = sum / row[r];
+  }
+}
+
+cluster::dist::Mahalanobis::data_t cluster::dist::Mahalanobis::operator () (
+  cluster::span<const data_t> x,
+  cluster::span<const data_t> y
+) const {
+  if (x.size() != this->d || y.size() != this->d) {
+    std::stringstream s;
+    s << "Expected " << this->d << " entries in both data entries; "
+      << "instead found " << x.size() << " and " << y.size();
+    throw s.str();
+  }
+
+  // Reused per thread so distances between in-place rows don't allocate.
+  thread_local std::vector<data_t> diff;
+  diff.resize(this->d);
+
+  for (index_t v = 0; v < this->d; v++) {
+    diff[v] = x[v] - y[v];
+  }
+
+  this->solve(diff);
+  data_t sum = 0;
+
+  for (auto z : diff) {
+    sum += z * z;
+  }
+
+  return std::sqrt(sum);
+}
+
+std::vector<cluster::dist::Mahalanobis::data_t>
+cluster::dist::Mahalanobis::whiten(std::vector<data_t> x) const {
+  this->solve(x);
+  return x;
+}
+
+cluster::Dataset cluster::dist::Mahalanobis::whiten(
+  const cluster::Dataset& data,
+  cluster::exec::Policy policy
+) const {
+  std::vector<std::vector<data_t>> rows(data.nObs());
+
+  cluster::exec::parallelFor(
+    data.nObs(),
+    policy,
+    [&](std::size_t begin, std::size_t end, unsigned int) {
+      for (std::size_t i = begin; i < end; i++) {
+        rows[i] = this->whiten(data[i]);
+      }
+    }
+  );
+
+  cluster::Dataset whitened(this->d);
+
+  for (index_t i = 0; i < data.nObs(); i++) {
+    whitened.add(rows[i], data.weight(i));
+  }
+
+  return whitened;
+}
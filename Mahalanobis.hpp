@@ -0,0 +1,54 @@
+#ifndef MAHALANOBIS_H
+#define MAHALANOBIS_H
+
+#include "ns.hpp"
+#include "Dataset.hpp"
+#include "Span.hpp"
+
+#include <vector>
+
+// Mahalanobis distance under the covariance of a reference dataset. The
+// covariance is factored (Cholesky) once; whitening data with the factor
+// turns Mahalanobis distances into euclidean ones, so
+//
+//   agg::agglomerativeClustering(m.whiten(data), dist::euclidean, ...)
+//
+// clusters by Mahalanobis distance with any linkage, at euclidean cost.
+class cluster::dist::Mahalanobis {
+public:
+  using index_t = cluster::index_t;
+  using data_t = cluster::data_t;
+
+private:
+  index_t d;
+  // Lower triangle of the Cholesky factor, row-major.
+  std::vector<data_t> factor;
+
+  void solve(std::vector<data_t>& x) const;
+
+public:
+  // Constructors.
+  Mahalanobis(
+    const cluster::Dataset& reference,
+    cluster::exec::Policy policy = cluster::exec::Policy::threads
+  );
+
+  // Basic information.
+  index_t nVars() const;
+
+  // The distance between two observations.
+  data_t operator () (
+    cluster::span<const data_t> x,
+    cluster::span<const data_t> y
+  ) const;
+
+  // Map observations to coordinates in which euclidean distance is this
+  // Mahalanobis distance.
+  std::vector<data_t> whiten(std::vector<data_t> x) const;
+  cluster::Dataset whiten(
+    const cluster::Dataset& data,
+    cluster::exec::Policy policy = cluster::exec::Policy::threads
+  ) const;
+};
+
+#endif
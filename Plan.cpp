@@ -0,0 +1,475 @@
+#include "ns.hpp"
+#include "Plan.hpp"
+#include "Dataset.hpp"
+#include "Dendrogram.hpp"
+#include "DistanceMatrix.hpp"
+#include "Exec.hpp"
+#include "IncrementalHierarchy.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <iomanip>
+#include <ostream>
+#include <sstream>
+
+// Costs that aren't measured at planning time. They're rough, which is why
+// planned() logs its estimates next to how long the run really took.
+namespace {
+  // Reading or updating one entry of a distance matrix.
+  const double entrySeconds = 1e-8;
+  // How many bare distances one distance inside a linkage is worth, once
+  // row lookups and weights are counted.
+  const double linkageOverhead = 3;
+  // Starting and joining one worker thread for a parallel step.
+  const double threadSeconds = 30e-6;
+
+  struct Cost {
+    std::size_t memory;
+    double seconds;
+  };
+}
+
+// Time distances between every pair of up to 48 evenly spaced rows, for at
+// least a couple of milliseconds.
+static double timeDistance(
+  const cluster::Dataset& data,
+  cluster::dist::DistanceMeasure dist
+) {
+  cluster::index_t n = data.nObs();
+  cluster::index_t m = std::min<cluster::index_t>(n, 48);
+  std::vector<std::vector<cluster::data_t>> rows;
+
+  for (cluster::index_t i = 0; i < m; i++) {
+    rows.push_back(data[(std::size_t)i * n / m]);
+  }
+
+  if (m < 2) {
+    return 0;
+  }
+
+  using clock = std::chrono::steady_clock;
+  volatile cluster::data_t sink = 0;
+  double evaluations = 0;
+  auto start = clock::now();
+  std::chrono::duration<double> elapsed(0);
+
+  while (elapsed.count() < 2e-3) {
+    for (cluster::index_t i = 0; i < m; i++) {
+      for (cluster::index_t j = i + 1; j < m; j++) {
+        sink = sink + dist(rows[i], rows[j]);
+      }
+    }
+
+    evaluations += (double)m * (m - 1) / 2;
+    elapsed = clock::now() - start;
+  }
+
+  return elapsed.count() / evaluations;
+}
+
+static double threadOverhead(double parallelSteps, unsigned int threads) {
+  return threads > 1 ? parallelSteps * threads * threadSeconds : 0;
+}
+
+// The generic engine makes about n^2 / 2 linkage calls up front, then each
+// merge compares the new cluster against every other and rescans the rows
+// that pointed at it. Linkages between bigger clusters cost more, so count
+// about log2(n) distances' worth per pair on top.
+static Cost genericCost(
+  cluster::index_t n,
+  cluster::index_t d,
+  bool copiesData,
+  double distance,
+  unsigned int threads
+) {
+  double nd = n;
+  double evaluations = linkageOverhead * nd * nd / 2 *
+    (1 + std::log2(std::max(nd, 2.0)));
+
+  return {
+    (std::size_t)n * (
+      sizeof(cluster::Dataset) + sizeof(cluster::data_t) + sizeof(int) +
+      5 * sizeof(cluster::index_t) + 1
+    ) + (copiesData ? (std::size_t)n * d * sizeof(cluster::data_t) : 0),
+    evaluations * distance / threads + threadOverhead(2 * nd, threads)
+  };
+}
+
+// The matrix takes n(n-1)/2 distances, then every merge makes a handful of
+// passes over a row of it: finding the closest pair, updating the merged
+// row and rescanning the rows that pointed at it.
+static Cost matrixCost(
+  cluster::index_t n,
+  cluster::index_t d,
+  double distance,
+  unsigned int threads
+) {
+  double nd = n;
+  double entries = nd * (nd - 1) / 2;
+  std::size_t rows = (std::size_t)n * (
+    d * sizeof(cluster::data_t) + sizeof(std::vector<cluster::data_t>)
+  );
+  std::size_t bookkeeping = (std::size_t)n * (
+    2 * sizeof(cluster::data_t) + 2 * sizeof(cluster::index_t) + 1
+  );
+
+  return {
+    (std::size_t)entries * sizeof(cluster::data_t) + std::max(rows, bookkeeping),
+    entries * distance / threads + 8 * nd * nd * entrySeconds / threads +
+      threadOverhead(3 * nd, threads)
+  };
+}
+
+// Inserting a row walks it down from the root, comparing it with both
+// children's centroids at each step.
+static Cost insertCost(
+  cluster::index_t n,
+  cluster::index_t m,
+  cluster::index_t d,
+  double distance
+) {
+  std::size_t node = 2 * sizeof(cluster::data_t) +
+    3 * sizeof(cluster::index_t) + sizeof(std::vector<cluster::data_t>) +
+    sizeof(std::vector<cluster::index_t>) + d * sizeof(cluster::data_t);
+
+  return {
+    (std::size_t)n * (d * sizeof(cluster::data_t) + sizeof(cluster::index_t)) +
+      2 * (std::size_t)n * node,
+    (double)(n - m) * 4 * std::log2(std::max<double>(m, 2)) * distance
+  };
+}
+
+static bool fits(const Cost& cost, const cluster::agg::Budget& budget) {
+  return (budget.memory == 0 || cost.memory <= budget.memory) &&
+    (budget.seconds == 0 || cost.seconds <= budget.seconds);
+}
+
+static std::string overBudget(
+  const Cost& cost,
+  const cluster::agg::Budget& budget
+) {
+  return budget.memory > 0 && cost.memory > budget.memory
+    ? "over the memory budget"
+    : "over the time budget";
+}
+
+static std::string bytes(std::size_t n) {
+  const char* units[] = {"B", "KiB", "MiB", "GiB", "TiB"};
+  double value = n;
+  int unit = 0;
+
+  while (value >= 1024 && unit < 4) {
+    value /= 1024;
+    unit++;
+  }
+
+  std::stringstream s;
+  s << std::setprecision(3) << value << " " << units[unit];
+  return s.str();
+}
+
+const char* cluster::agg::Plan::nameOf(cluster::agg::Plan::Strategy strategy) {
+  switch (strategy) {
+    case Strategy::generic: return "generic";
+    case Strategy::matrix: return "matrix";
+    case Strategy::sample: return "sample";
+  }
+
+  return "";
+}
+
+cluster::agg::Plan cluster::agg::plan(
+  const cluster::Dataset& data,
+  cluster::dist::DistanceMeasure dist,
+  cluster::agg::Linkage linkage,
+  const cluster::agg::Budget& budget
+) {
+  using Strategy = cluster::agg::Plan::Strategy;
+
+  cluster::agg::Plan plan;
+  plan.nObs = data.nObs();
+  plan.nVars = data.nVars();
+  plan.sampleSize = plan.nObs;
+  plan.distanceSeconds = timeDistance(data, dist);
+
+  cluster::index_t n = plan.nObs;
+  cluster::index_t d = plan.nVars;
+  double distance = plan.distanceSeconds;
+  unsigned int most = cluster::exec::concurrency();
+
+  bool builtInLinkage =
+    linkage == cluster::agg::lSingle || linkage == cluster::agg::lComplete ||
+    linkage == cluster::agg::lAverage || linkage == cluster::agg::lCentroid ||
+    linkage == cluster::agg::lWards;
+  bool builtInDist = !cluster::dist::nameOf(dist).empty();
+
+  // Only the built-in linkages have a Lance-Williams update, and centroid
+  // and Ward's updates assume euclidean distances.
+  std::string noMatrix;
+
+  if (!builtInLinkage) {
+    noMatrix = "no Lance-Williams update for this linkage";
+  } else if (
+    (linkage == cluster::agg::lCentroid || linkage == cluster::agg::lWards) &&
+    dist != cluster::dist::euclidean
+  ) {
+    noMatrix = "the Lance-Williams update needs euclidean distances";
+  }
+
+  // The cheaper of running serially or on every thread. Custom linkages and
+  // distances aren't known to be safe to call from several threads at once,
+  // so strategies that call them stay serial; the matrix only calls the
+  // distance.
+  auto exact = [&](Strategy strategy, cluster::index_t rows, bool copiesData) {
+    cluster::agg::Plan::Estimate best = {strategy, 1, 0, 0, ""};
+    bool threadSafe =
+      builtInDist && (builtInLinkage || strategy == Strategy::matrix);
+
+    for (unsigned int threads : {1u, threadSafe ? most : 1u}) {
+      Cost cost = strategy == Strategy::matrix
+        ? matrixCost(rows, d, distance, threads)
+        : genericCost(rows, d, copiesData, distance, threads);
+
+      if (threads == 1 || cost.seconds < best.seconds) {
+        best.threads = threads;
+        best.memory = cost.memory;
+        best.seconds = cost.seconds;
+      }
+    }
+
+    if (strategy == Strategy::matrix && !noMatrix.empty()) {
+      best.rejected = noMatrix;
+    } else if (!fits({best.memory, best.seconds}, budget)) {
+      best.rejected = overBudget({best.memory, best.seconds}, budget);
+    }
+
+    return best;
+  };
+
+  std::vector<cluster::agg::Plan::Estimate> estimates = {
+    exact(Strategy::matrix, n, false),
+    exact(Strategy::generic, n, false)
+  };
+
+  // Halve the sample until clustering it exactly, then inserting the rest,
+  // fits in budget.
+  cluster::agg::Plan::Estimate sample = {Strategy::sample, 1, 0, 0, ""};
+  Strategy sampleExact = Strategy::generic;
+
+  if (!budget.approximate) {
+    sample.rejected = "approximate results not allowed";
+  } else if (linkage != cluster::agg::lCentroid) {
+    sample.rejected = "inserting rows needs centroid linkage";
+  } else {
+    sample.rejected = "no sample fits in budget";
+
+    for (cluster::index_t m = n / 2; m >= 2; m /= 2) {
+      Cost insert = insertCost(n, m, d, distance);
+      bool found = false;
+
+      for (Strategy strategy : {Strategy::matrix, Strategy::generic}) {
+        auto e = exact(strategy, m, true);
+        e.memory += insert.memory;
+        e.seconds += insert.seconds;
+
+        if (
+          (strategy != Strategy::matrix || noMatrix.empty()) &&
+          fits({e.memory, e.seconds}, budget) &&
+          (!found || e.seconds < sample.seconds)
+        ) {
+          found = true;
+          sampleExact = strategy;
+          sample = e;
+          sample.strategy = Strategy::sample;
+          sample.rejected = "";
+          plan.sampleSize = m;
+        }
+      }
+
+      if (found) {
+        break;
+      }
+    }
+  }
+
+  estimates.push_back(sample);
+
+  auto chosen = estimates.end();
+
+  for (auto it = estimates.begin(); it != estimates.end(); ++it) {
+    if (
+      it->rejected.empty() &&
+      (chosen == estimates.end() || it->seconds < chosen->seconds)
+    ) {
+      chosen = it;
+    }
+  }
+
+  if (chosen == estimates.end()) {
+    std::stringstream s;
+    s << "Nothing fits the budget for clustering " << n << " rows:\n";
+
+    for (auto& e : estimates) {
+      s << "  " << cluster::agg::Plan::nameOf(e.strategy) << ": "
+        << e.rejected << "\n";
+    }
+
+    throw s.str();
+  }
+
+  std::rotate(estimates.begin(), chosen, chosen + 1);
+  plan.strategy = estimates.front().strategy;
+  plan.exact = plan.strategy == Strategy::sample
+    ? sampleExact
+    : plan.strategy;
+  plan.threads = estimates.front().threads;
+  plan.policy = plan.threads > 1
+    ? cluster::exec::Policy::threads
+    : cluster::exec::Policy::serial;
+  plan.estimates = estimates;
+
+  if (plan.strategy != Strategy::sample) {
+    plan.sampleSize = n;
+  }
+
+  return plan;
+}
+
+std::ostream& cluster::agg::operator << (
+  std::ostream& out,
+  const cluster::agg::Plan& plan
+) {
+  out << "plan for " << plan.nObs << " x " << plan.nVars << ": "
+      << cluster::agg::Plan::nameOf(plan.strategy);
+
+  if (plan.strategy == cluster::agg::Plan::Strategy::sample) {
+    out << " of " << plan.sampleSize << " rows, "
+        << cluster::agg::Plan::nameOf(plan.exact);
+  }
+
+  out << " on " << plan.threads
+      << (plan.threads == 1 ? " thread" : " threads") << "\n";
+
+  for (auto& e : plan.estimates) {
+    out << "  " << cluster::agg::Plan::nameOf(e.strategy) << ": ";
+
+    if (!e.rejected.empty()) {
+      out << "rejected, " << e.rejected << "\n";
+      continue;
+    }
+
+    out << bytes(e.memory) << ", " << std::setprecision(3) << e.seconds
+        << " s on " << e.threads << "\n";
+  }
+
+  return out;
+}
+
+// Relabel clusters in order of each one's first observation.
+static void renumber(std::vector<cluster::index_t>& labels) {
+  std::vector<cluster::index_t> renamed(labels.size(), -1);
+  cluster::index_t next = 0;
+
+  for (auto& label : labels) {
+    if (renamed[label] == (cluster::index_t)-1) {
+      renamed[label] = next++;
+    }
+
+    label = renamed[label];
+  }
+}
+
+std::vector<cluster::index_t> cluster::agg::planned(
+  const cluster::Dataset& data,
+  cluster::dist::DistanceMeasure dist,
+  cluster::agg::Linkage linkage,
+  cluster::index_t k,
+  const cluster::agg::Plan& plan,
+  std::ostream* log
+) {
+  using Strategy = cluster::agg::Plan::Strategy;
+
+  if (plan.nObs != data.nObs() || plan.nVars != data.nVars()) {
+    std::stringstream s;
+    s << "Plan was made for " << plan.nObs << " x " << plan.nVars
+      << " data, not " << data.nObs() << " x " << data.nVars();
+    throw s.str();
+  }
+
+  if (log) {
+    *log << plan;
+  }
+
+  auto build = [&](const cluster::Dataset& rows) {
+    return plan.exact == Strategy::matrix
+      ? cluster::agg::lanceWilliams(
+          cluster::dist::pairwise(rows, dist, plan.policy),
+          rows.weights(),
+          linkage,
+          plan.policy
+        )
+      : cluster::agg::hierarchy(rows, dist, linkage, plan.policy);
+  };
+
+  auto start = std::chrono::steady_clock::now();
+  std::vector<cluster::index_t> labels;
+
+  if (plan.strategy != Strategy::sample) {
+    labels = build(data).cut(k);
+  } else {
+    // Take every step-th row, cluster those, then insert the others.
+    cluster::index_t n = data.nObs();
+    cluster::index_t step = (n + plan.sampleSize - 1) / plan.sampleSize;
+    cluster::Dataset sample = data.slice(0, n, step).materialize();
+    std::vector<cluster::index_t> others;
+
+    for (cluster::index_t i = 0; i < n; i++) {
+      if (i % step != 0) {
+        others.push_back(i);
+      }
+    }
+
+    cluster::agg::IncrementalHierarchy tree(
+      sample, build(sample), dist, linkage
+    );
+
+    if (!others.empty()) {
+      tree.insert(data.rows(others));
+    }
+
+    auto cut = tree.cut(k);
+    labels.resize(n);
+
+    for (cluster::index_t i = 0; i < sample.nObs(); i++) {
+      labels[i * step] = cut[i];
+    }
+
+    for (std::size_t j = 0; j < others.size(); j++) {
+      labels[others[j]] = cut[sample.nObs() + j];
+    }
+
+    renumber(labels);
+  }
+
+  if (log) {
+    std::chrono::duration<double> took =
+      std::chrono::steady_clock::now() - start;
+    *log << "  took " << std::setprecision(3) << took.count() << " s\n";
+  }
+
+  return labels;
+}
+
+std::vector<cluster::index_t> cluster::agg::planned(
+  const cluster::Dataset& data,
+  cluster::dist::DistanceMeasure dist,
+  cluster::agg::Linkage linkage,
+  cluster::index_t k,
+  const cluster::agg::Budget& budget,
+  std::ostream* log
+) {
+  return cluster::agg::planned(
+    data, dist, linkage, k, cluster::agg::plan(data, dist, linkage, budget), log
+  );
+}
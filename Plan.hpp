@@ -0,0 +1,60 @@
+#ifndef PLAN_H
+#define PLAN_H
+
+#include "ns.hpp"
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+// What agg::plan() may spend: working memory in bytes, on top of the data
+// itself, and wall-clock seconds. 0 means no limit. Clustering a sample and
+// inserting the rest is only considered when approximate is set.
+struct cluster::agg::Budget {
+  std::size_t memory = 0;
+  double seconds = 0;
+  bool approximate = false;
+};
+
+// How agg::plan() decided to cluster a dataset, with the estimates behind
+// the decision so they can be checked against measured runs.
+struct cluster::agg::Plan {
+  enum class Strategy {
+    // The nearest-neighbour cache behind hierarchy(): O(n) memory, any
+    // linkage.
+    generic,
+    // A distance matrix merged by lanceWilliams(): O(n^2) memory, built-in
+    // linkages only.
+    matrix,
+    // One of the above on an evenly spaced sample, with the other rows
+    // inserted into the result through an IncrementalHierarchy. Centroid
+    // linkage only.
+    sample
+  };
+
+  struct Estimate {
+    Strategy strategy;
+    unsigned int threads;
+    std::size_t memory;
+    double seconds;
+    // Why the strategy can't be used; empty if it can.
+    std::string rejected;
+  };
+
+  Strategy strategy;
+  // What the sample is clustered with, under Strategy::sample.
+  Strategy exact;
+  cluster::exec::Policy policy;
+  unsigned int threads;
+  index_t nObs;
+  index_t nVars;
+  index_t sampleSize;
+  // Measured time for one distance between two rows of the data.
+  double distanceSeconds;
+  // Every strategy considered, the chosen one first.
+  std::vector<Estimate> estimates;
+
+  static const char* nameOf(Strategy strategy);
+};
+
+#endif
@@ -0,0 +1,439 @@
+#include "ns.hpp"
+#include "Dataset.hpp"
+#include "Exec.hpp"
+#include "Projection.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <numeric>
+#include <random>
+#include <sstream>
+
+using Matrix = std::vector<std::vector<cluster::data_t>>;
+
+// Eigenvalues and eigenvectors of the symmetric d x d matrix a (row-major),
+// by cyclic Jacobi rotations, largest eigenvalue first.
+static void eigen(
+  std::vector<cluster::data_t> a,
+  cluster::index_t d,
+  std::vector<cluster::data_t>& values,
+  Matrix& vectors
+) {
+  auto at = [&](cluster::index_t r, cluster::index_t c) -> cluster::data_t& {
+    return a[(std::size_t)r * d + c];
+  };
+
+  Matrix v(d, std::vector<cluster::data_t>(d));
+  for (cluster::index_t i = 0; i < d; i++) v[i][i] = 1;
+
+  for (int sweep = 0; sweep < 100; sweep++) {
+    cluster::data_t off = 0, diag = 0;
+
+    for (cluster::index_t p = 0; p < d; p++) {
+      diag += at(p, p) * at(p, p);
+      for (cluster::index_t q = p + 1; q < d; q++) off += at(p, q) * at(p, q);
+    }
+
+    if (off <= 1e-30 * diag || off == 0) break;
+
+    for (cluster::index_t p = 0; p < d; p++) {
+      for (cluster::index_t q = p + 1; q < d; q++) {
+        cluster::data_t apq = at(p, q);
+        if (apq == 0) continue;
+
+        cluster::data_t theta = (at(q, q) - at(p, p)) / (2 * apq);
+        cluster::data_t t = (theta >= 0 ? 1 : -1) /
+          (std::abs(theta) + std::sqrt(theta * theta + 1));
+        cluster::data_t c = 1 / std::sqrt(t * t + 1);
+        cluster::data_t s = t * c;
+
+        for (cluster::index_t r = 0; r < d; r++) {
+          if (r == p || r == q) continue;
+
+          cluster::data_t arp = at(r, p), arq = at(r, q);
+          at(r, p) = at(p, r) = c * arp - s * arq;
+          at(r, q) = at(q, r) = c * arq + s * arp;
+        }
+
+        at(p, p) -= t * apq;
+        at(q, q) += t * apq;
+        at(p, q) = at(q, p) = 0;
+
+        for (cluster::index_t r = 0; r < d; r++) {
+          cluster::data_t vrp = v[r][p], vrq = v[r][q];
+          v[r][p] = c * vrp - s * vrq;
+          v[r][q] = s * vrp + c * vrq;
+        }
+      }
+    }
+  }
+
+  std::vector<cluster::index_t> order(d);
+  std::iota(order.begin(), order.end(), 0);
+  std::sort(order.begin(), order.end(), [&](auto x, auto y) {
+    return at(x, x) > at(y, y);
+  });
+
+  values.clear();
+  vectors.assign(d, std::vector<cluster::data_t>(d));
+
+  for (cluster::index_t k = 0; k < d; k++) {
+    values.push_back(at(order[k], order[k]));
+    for (cluster::index_t r = 0; r < d; r++) vectors[k][r] = v[r][order[k]];
+  }
+}
+
+// Orthonormalizes a set of equal-length columns in place (modified
+// Gram-Schmidt), dropping any that turn out dependent.
+static void orthonormalize(Matrix& columns) {
+  Matrix kept;
+
+  for (auto& column : columns) {
+    for (auto& q : kept) {
+      cluster::data_t dot = 0;
+      for (std::size_t i = 0; i < q.size(); i++) dot += q[i] * column[i];
+      for (std::size_t i = 0; i < q.size(); i++) column[i] -= dot * q[i];
+    }
+
+    cluster::data_t norm = 0;
+    for (auto x : column) norm += x * x;
+    norm = std::sqrt(norm);
+
+    if (norm > 1e-12) {
+      for (auto& x : column) x /= norm;
+      kept.push_back(std::move(column));
+    }
+  }
+
+  columns = std::move(kept);
+}
+
+cluster::Projection::Projection(
+  cluster::Projection::index_t inDims,
+  std::string prefix
+) : inDims(inDims), prefix(prefix) {}
+
+cluster::Projection cluster::Projection::fromEigen(
+  std::vector<cluster::Projection::data_t> center,
+  std::vector<cluster::Projection::data_t> values,
+  Matrix vectors,
+  cluster::Projection::data_t totalVariance,
+  cluster::Projection::index_t dims,
+  cluster::Projection::data_t ratio
+) {
+  cluster::Projection projection(center.size(), "PC");
+  projection.center = std::move(center);
+
+  // With a target ratio, keep components until they explain enough.
+  if (ratio > 0) {
+    cluster::Projection::data_t explained = 0;
+    dims = 0;
+
+    while (dims < values.size() && explained < ratio * totalVariance) {
+      explained += values[dims++];
+    }
+  }
+
+  dims = std::min<cluster::Projection::index_t>(dims, values.size());
+
+  for (cluster::Projection::index_t k = 0; k < dims; k++) {
+    projection.dense.push_back(std::move(vectors[k]));
+    projection.explained.push_back(
+      totalVariance > 0 ? values[k] / totalVariance : 0
+    );
+  }
+
+  return projection;
+}
+
+static std::vector<cluster::data_t> centre(
+  const cluster::Dataset& data,
+  cluster::exec::Policy policy
+) {
+  return data.weighted()
+    ? data.applyColWeighted(cluster::stat::mean, policy)
+    : data.applyCol(cluster::stat::mean, policy);
+}
+
+cluster::Projection cluster::Projection::pca(
+  const cluster::Dataset& data,
+  cluster::Projection::index_t dims,
+  cluster::exec::Policy policy
+) {
+  cluster::index_t d = data.nVars();
+  auto cov = cluster::stat::covariance(data, policy);
+  cluster::data_t total = 0;
+  for (cluster::index_t v = 0; v < d; v++) total += cov[(std::size_t)v * d + v];
+
+  std::vector<cluster::data_t> values;
+  Matrix vectors;
+  eigen(cov, d, values, vectors);
+
+  return fromEigen(centre(data, policy), values, vectors, total, dims, 0);
+}
+
+cluster::Projection cluster::Projection::pcaExplaining(
+  const cluster::Dataset& data,
+  cluster::Projection::data_t ratio,
+  cluster::exec::Policy policy
+) {
+  if (!(ratio > 0 && ratio <= 1)) {
+    std::stringstream s;
+    s << "Expected a variance ratio in (0, 1]; instead found " << ratio;
+    throw s.str();
+  }
+
+  cluster::index_t d = data.nVars();
+  auto cov = cluster::stat::covariance(data, policy);
+  cluster::data_t total = 0;
+  for (cluster::index_t v = 0; v < d; v++) total += cov[(std::size_t)v * d + v];
+
+  std::vector<cluster::data_t> values;
+  Matrix vectors;
+  eigen(cov, d, values, vectors);
+
+  return fromEigen(centre(data, policy), values, vectors, total, 0, ratio);
+}
+
+cluster::Projection cluster::Projection::randomizedPca(
+  const cluster::Dataset& data,
+  cluster::Projection::index_t dims,
+  cluster::Projection::index_t oversample,
+  cluster::Projection::index_t iterations,
+  unsigned int seed,
+  cluster::exec::Policy policy
+) {
+  cluster::index_t n = data.nObs();
+  cluster::index_t d = data.nVars();
+  cluster::index_t l = std::min(dims + oversample, std::min(n, d));
+  auto mean = centre(data, policy);
+  auto weights = data.weights();
+  cluster::data_t totalWeight = 0;
+  for (auto w : weights) totalWeight += w;
+
+  // The centred data, each row scaled by the root of its weight.
+  std::vector<cluster::data_t> x((std::size_t)n * d);
+  cluster::data_t total = 0;
+
+  for (cluster::index_t i = 0; i < n; i++) {
+    auto row = data[i];
+    cluster::data_t scale = std::sqrt(weights[i]);
+
+    for (cluster::index_t v = 0; v < d; v++) {
+      x[(std::size_t)i * d + v] = scale * (row[v] - mean[v]);
+      total += x[(std::size_t)i * d + v] * x[(std::size_t)i * d + v];
+    }
+  }
+
+  total /= totalWeight - 1;
+
+  // X times columns of length d, and X transposed times columns of length n.
+  auto times = [&](const Matrix& in) {
+    Matrix out(in.size(), std::vector<cluster::data_t>(n));
+
+    cluster::exec::parallelFor(
+      n,
+      policy,
+      [&](std::size_t begin, std::size_t end, unsigned int) {
+        for (std::size_t i = begin; i < end; i++) {
+          const cluster::data_t* row = &x[i * d];
+
+          for (std::size_t c = 0; c < in.size(); c++) {
+            cluster::data_t sum = 0;
+            for (cluster::index_t v = 0; v < d; v++) sum += row[v] * in[c][v];
+            out[c][i] = sum;
+          }
+        }
+      }
+    );
+
+    return out;
+  };
+
+  auto transposeTimes = [&](const Matrix& in) {
+    Matrix out(in.size(), std::vector<cluster::data_t>(d));
+
+    cluster::exec::parallelFor(
+      in.size(),
+      policy,
+      [&](std::size_t begin, std::size_t end, unsigned int) {
+        for (std::size_t c = begin; c < end; c++) {
+          for (cluster::index_t i = 0; i < n; i++) {
+            const cluster::data_t* row = &x[(std::size_t)i * d];
+            for (cluster::index_t v = 0; v < d; v++) {
+              out[c][v] += row[v] * in[c][i];
+            }
+          }
+        }
+      },
+      1
+    );
+
+    return out;
+  };
+
+  // Sample the range of X, sharpen it with a few power iterations, and
+  // find the principal components within that range.
+  std::mt19937 random(seed);
+  std::normal_distribution<double> gaussian;
+  Matrix omega(l, std::vector<cluster::data_t>(d));
+
+  for (auto& column : omega) {
+    for (auto& value : column) value = gaussian(random);
+  }
+
+  Matrix q = times(omega);
+  orthonormalize(q);
+
+  for (cluster::index_t it = 0; it < iterations; it++) {
+    Matrix z = transposeTimes(q);
+    orthonormalize(z);
+    q = times(z);
+    orthonormalize(q);
+  }
+
+  // B = Q'X, so the components are the top eigenvectors of B'B, reached
+  // through the small eigenproblem of BB'.
+  Matrix b = transposeTimes(q);
+  cluster::index_t m = b.size();
+  std::vector<cluster::data_t> gram((std::size_t)m * m);
+
+  for (cluster::index_t r = 0; r < m; r++) {
+    for (cluster::index_t c = 0; c < m; c++) {
+      cluster::data_t sum = 0;
+      for (cluster::index_t v = 0; v < d; v++) sum += b[r][v] * b[c][v];
+      gram[(std::size_t)r * m + c] = sum;
+    }
+  }
+
+  std::vector<cluster::data_t> values;
+  Matrix small;
+  eigen(gram, m, values, small);
+
+  Matrix vectors;
+
+  for (cluster::index_t k = 0; k < m; k++) {
+    std::vector<cluster::data_t> component(d);
+    cluster::data_t sigma = std::sqrt(std::max<cluster::data_t>(values[k], 0));
+
+    for (cluster::index_t r = 0; r < m; r++) {
+      for (cluster::index_t v = 0; v < d; v++) {
+        component[v] += b[r][v] * small[k][r];
+      }
+    }
+
+    for (auto& value : component) value = sigma > 0 ? value / sigma : 0;
+
+    vectors.push_back(component);
+    values[k] /= totalWeight - 1;
+  }
+
+  return fromEigen(mean, values, vectors, total, dims, 0);
+}
+
+cluster::Projection cluster::Projection::sparseRandom(
+  cluster::Projection::index_t nVars,
+  cluster::Projection::index_t dims,
+  unsigned int seed
+) {
+  if (dims == 0) {
+    throw std::string("Expected at least one dimension to project onto");
+  }
+
+  cluster::Projection projection(nVars, "RP");
+
+  // Each entry is +-sqrt(s / dims) with probability 1 / 2s each, and 0
+  // otherwise, with s = sqrt(nVars).
+  cluster::data_t s = std::sqrt((cluster::data_t)std::max(nVars, 1u));
+  cluster::data_t scale = std::sqrt(s / dims);
+  std::mt19937 random(seed);
+  std::uniform_real_distribution<double> uniform;
+
+  projection.sparse.resize(dims);
+
+  for (auto& row : projection.sparse) {
+    for (cluster::Projection::index_t v = 0; v < nVars; v++) {
+      double u = uniform(random) * s;
+
+      if (u < 0.5) {
+        row.push_back({v, scale});
+      } else if (u < 1) {
+        row.push_back({v, -scale});
+      }
+    }
+  }
+
+  return projection;
+}
+
+cluster::Projection::index_t cluster::Projection::inputDims() const {
+  return this->inDims;
+}
+
+cluster::Projection::index_t cluster::Projection::outputDims() const {
+  return this->dense.empty() ? this->sparse.size() : this->dense.size();
+}
+
+const std::vector<cluster::Projection::data_t>&
+cluster::Projection::explainedVariance() const {
+  return this->explained;
+}
+
+cluster::Dataset cluster::Projection::transform(
+  const cluster::Dataset& data,
+  cluster::exec::Policy policy
+) const {
+  if (data.nVars() != this->inDims) {
+    std::stringstream s;
+    s << "Expected data with " << this->inDims << " variables; "
+      << "instead found " << data.nVars();
+    throw s.str();
+  }
+
+  index_t k = this->outputDims();
+  Matrix rows(data.nObs(), std::vector<data_t>(k));
+
+  cluster::exec::parallelFor(
+    data.nObs(),
+    policy,
+    [&](std::size_t begin, std::size_t end, unsigned int) {
+      for (std::size_t i = begin; i < end; i++) {
+        auto row = data[i];
+
+        for (index_t v = 0; v < this->center.size(); v++) {
+          row[v] -= this->center[v];
+        }
+
+        for (index_t c = 0; c < k; c++) {
+          data_t sum = 0;
+
+          if (this->dense.empty()) {
+            for (auto& entry : this->sparse[c]) {
+              sum += entry.second * row[entry.first];
+            }
+          } else {
+            for (index_t v = 0; v < this->inDims; v++) {
+              sum += this->dense[c][v] * row[v];
+            }
+          }
+
+          rows[i][c] = sum;
+        }
+      }
+    }
+  );
+
+  std::vector<std::string> names;
+
+  for (index_t c = 0; c < k; c++) {
+    names.push_back(this->prefix + std::to_string(c + 1));
+  }
+
+  cluster::Dataset projected(names);
+
+  for (index_t i = 0; i < data.nObs(); i++) {
+    projected.add(rows[i], data.weight(i));
+  }
+
+  return projected;
+}
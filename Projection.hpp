@@ -0,0 +1,87 @@
+#ifndef PROJECTION_H
+#define PROJECTION_H
+
+#include "ns.hpp"
+#include "Dataset.hpp"
+
+#include <string>
+#include <utility>
+#include <vector>
+
+// A linear map onto fewer variables, fitted once and then applied to any
+// data with the same variables: principal components (exact, or randomized
+// for wide data) or a sparse random projection.
+class cluster::Projection {
+public:
+  using index_t = cluster::index_t;
+  using data_t = cluster::data_t;
+
+private:
+  index_t inDims;
+  std::vector<data_t> center;
+  std::vector<std::vector<data_t>> dense;
+  std::vector<std::vector<std::pair<index_t, data_t>>> sparse;
+  std::vector<data_t> explained;
+  std::string prefix;
+
+  Projection(index_t inDims, std::string prefix);
+
+  static Projection fromEigen(
+    std::vector<data_t> center,
+    std::vector<data_t> values,
+    std::vector<std::vector<data_t>> vectors,
+    data_t totalVariance,
+    index_t dims,
+    data_t ratio
+  );
+
+public:
+  // Principal components from the eigenvectors of the covariance matrix,
+  // keeping either the first `dims` or as many as it takes to explain
+  // `ratio` of the total variance.
+  static Projection pca(
+    const cluster::Dataset& data,
+    index_t dims,
+    cluster::exec::Policy policy = cluster::exec::Policy::threads
+  );
+  static Projection pcaExplaining(
+    const cluster::Dataset& data,
+    data_t ratio,
+    cluster::exec::Policy policy = cluster::exec::Policy::threads
+  );
+
+  // The first `dims` principal components from a randomized SVD of the
+  // centred data, for when the full covariance matrix is too big to
+  // decompose.
+  static Projection randomizedPca(
+    const cluster::Dataset& data,
+    index_t dims,
+    index_t oversample = 10,
+    index_t iterations = 2,
+    unsigned int seed = 0,
+    cluster::exec::Policy policy = cluster::exec::Policy::threads
+  );
+
+  // A very sparse random projection (Li, Hastie and Church) of nVars
+  // variables onto `dims`, which roughly preserves pairwise distances.
+  static Projection sparseRandom(
+    index_t nVars,
+    index_t dims,
+    unsigned int seed = 0
+  );
+
+  // Basic information.
+  index_t inputDims() const;
+  index_t outputDims() const;
+
+  // The share of the total variance explained by each kept component
+  // (empty for random projections).
+  const std::vector<data_t>& explainedVariance() const;
+
+  cluster::Dataset transform(
+    const cluster::Dataset& data,
+    cluster::exec::Policy policy = cluster::exec::Policy::threads
+  ) const;
+};
+
+#endif
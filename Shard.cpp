@@ -0,0 +1,390 @@
+#include "ns.hpp"
+#include "Dataset.hpp"
+#include "DistanceMatrix.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// Every message is a type and a payload length followed by the payload.
+// Numbers and values are sent in the sender's native layout, so all
+// machines taking part must agree on it; the job carries sizeof(data_t) so
+// a worker can at least refuse a mismatched one.
+//
+//   job:    data_t size, metric name, nObs, nVars, then the values
+//   tile:   first and one-past-last condensed offset
+//   result: the tile's offsets, then its distances
+//   error:  a message
+//   stop:   empty
+namespace {
+  enum class Message : std::uint32_t { job = 1, tile, result, error, stop };
+
+  struct Header {
+    Message type;
+    std::uint64_t length;
+  };
+}
+
+static void writeAll(int fd, const void* buffer, std::size_t length) {
+  const char* bytes = static_cast<const char*>(buffer);
+
+  while (length > 0) {
+    // MSG_NOSIGNAL keeps a dead peer from killing us with SIGPIPE.
+    ssize_t written = send(fd, bytes, length, MSG_NOSIGNAL);
+
+    if (written < 0 && errno == ENOTSOCK) {
+      written = write(fd, bytes, length);
+    }
+
+    if (written < 0) {
+      if (errno == EINTR) continue;
+      throw std::string("Shard connection failed: ") + std::strerror(errno);
+    }
+
+    bytes += written;
+    length -= written;
+  }
+}
+
+static void readAll(int fd, void* buffer, std::size_t length) {
+  char* bytes = static_cast<char*>(buffer);
+
+  while (length > 0) {
+    ssize_t got = read(fd, bytes, length);
+
+    if (got < 0) {
+      if (errno == EINTR) continue;
+      throw std::string("Shard connection failed: ") + std::strerror(errno);
+    }
+
+    if (got == 0) {
+      throw std::string("Shard connection closed unexpectedly");
+    }
+
+    bytes += got;
+    length -= got;
+  }
+}
+
+static void sendMessage(
+  int fd,
+  Message type,
+  const std::vector<char>& payload
+) {
+  // The fields go separately so Header's padding never reaches the socket.
+  std::uint64_t length = payload.size();
+  writeAll(fd, &type, sizeof(type));
+  writeAll(fd, &length, sizeof(length));
+  writeAll(fd, payload.data(), payload.size());
+}
+
+static Header receiveMessage(int fd, std::vector<char>& payload) {
+  Header header;
+  readAll(fd, &header.type, sizeof(header.type));
+  readAll(fd, &header.length, sizeof(header.length));
+  payload.resize(header.length);
+  readAll(fd, payload.data(), header.length);
+
+  if (header.type == Message::error) {
+    throw "Shard worker failed: " + std::string(payload.begin(), payload.end());
+  }
+
+  return header;
+}
+
+template <class T>
+static void pack(std::vector<char>& payload, const T& value) {
+  const char* bytes = reinterpret_cast<const char*>(&value);
+  payload.insert(payload.end(), bytes, bytes + sizeof(T));
+}
+
+template <class T>
+static T unpack(const std::vector<char>& payload, std::size_t& at) {
+  if (at + sizeof(T) > payload.size()) {
+    throw std::string("Shard message is truncated");
+  }
+
+  T value;
+  std::memcpy(&value, payload.data() + at, sizeof(T));
+  at += sizeof(T);
+  return value;
+}
+
+// Where row i of an n x n condensed matrix starts.
+static std::uint64_t rowStart(std::uint64_t n, std::uint64_t i) {
+  return i * (2 * n - i - 1) / 2;
+}
+
+void cluster::shard::serve(int fd) {
+  std::vector<char> payload;
+  std::vector<std::vector<cluster::data_t>> rows;
+  cluster::dist::DistanceMeasure* dist = nullptr;
+
+  try {
+    for (;;) {
+      Header header = receiveMessage(fd, payload);
+      std::size_t at = 0;
+
+      if (header.type == Message::stop) {
+        return;
+      }
+
+      if (header.type == Message::job) {
+        if (unpack<std::uint32_t>(payload, at) != sizeof(cluster::data_t)) {
+          throw std::string("Coordinator uses a different data_t layout");
+        }
+
+        std::uint32_t nameLength = unpack<std::uint32_t>(payload, at);
+        std::string name(payload.data() + at, nameLength);
+        at += nameLength;
+        dist = cluster::dist::byName(name);
+
+        if (!dist) {
+          throw "Unknown distance measure '" + name + "'";
+        }
+
+        std::uint32_t nObs = unpack<std::uint32_t>(payload, at);
+        std::uint32_t nVars = unpack<std::uint32_t>(payload, at);
+        rows.assign(nObs, std::vector<cluster::data_t>(nVars));
+
+        for (auto& row : rows) {
+          for (auto& value : row) {
+            value = unpack<cluster::data_t>(payload, at);
+          }
+        }
+      } else if (header.type == Message::tile) {
+        if (!dist) {
+          throw std::string("Received a tile before a job");
+        }
+
+        std::uint64_t begin = unpack<std::uint64_t>(payload, at);
+        std::uint64_t end = unpack<std::uint64_t>(payload, at);
+        std::uint64_t n = rows.size();
+        std::vector<char> result;
+        pack(result, begin);
+        pack(result, end);
+
+        // Find the row holding begin, then walk the tile in order.
+        std::uint64_t i = 0;
+        while (i + 1 < n && rowStart(n, i + 1) <= begin) i++;
+        std::uint64_t j = i + 1 + (begin - rowStart(n, i));
+
+        for (std::uint64_t offset = begin; offset < end; offset++) {
+          pack(result, dist(rows[i], rows[j]));
+
+          if (++j == n) {
+            i++;
+            j = i + 1;
+          }
+        }
+
+        sendMessage(fd, Message::result, result);
+      } else {
+        throw std::string("Unexpected message from coordinator");
+      }
+    }
+  } catch (std::string error) {
+    sendMessage(
+      fd,
+      Message::error,
+      std::vector<char>(error.begin(), error.end())
+    );
+  }
+}
+
+cluster::DistanceMatrix cluster::shard::pairwise(
+  const cluster::Dataset& data,
+  cluster::dist::DistanceMeasure dist,
+  const std::vector<int>& connections,
+  std::size_t tileSize
+) {
+  std::string name = cluster::dist::nameOf(dist);
+
+  if (name.empty()) {
+    throw std::string("Only the built-in distance measures can be sharded");
+  }
+
+  if (connections.empty()) {
+    throw std::string("Sharding needs at least one worker");
+  }
+
+  cluster::DistanceMatrix distances(data.nObs());
+  auto& values = distances.condensed();
+
+  // Every worker gets the whole dataset once.
+  std::vector<char> job;
+  pack<std::uint32_t>(job, sizeof(cluster::data_t));
+  pack<std::uint32_t>(job, name.size());
+  job.insert(job.end(), name.begin(), name.end());
+  pack<std::uint32_t>(job, data.nObs());
+  pack<std::uint32_t>(job, data.nVars());
+
+  for (cluster::index_t i = 0; i < data.nObs(); i++) {
+    for (auto value : data[i]) {
+      pack(job, value);
+    }
+  }
+
+  for (int fd : connections) {
+    sendMessage(fd, Message::job, job);
+  }
+
+  // Hand out tiles as results come back, keeping two in flight per worker
+  // so none of them sits idle waiting for its next tile.
+  tileSize = std::max<std::size_t>(tileSize, 1);
+  std::deque<std::uint64_t> pending;
+
+  for (std::uint64_t t = 0; t < values.size(); t += tileSize) {
+    pending.push_back(t);
+  }
+
+  std::vector<int> inFlight(connections.size());
+
+  auto dispatch = [&](std::size_t w) {
+    if (pending.empty()) return;
+
+    std::vector<char> tile;
+    pack<std::uint64_t>(tile, pending.front());
+    pack<std::uint64_t>(
+      tile,
+      std::min<std::uint64_t>(pending.front() + tileSize, values.size())
+    );
+    pending.pop_front();
+    sendMessage(connections[w], Message::tile, tile);
+    inFlight[w]++;
+  };
+
+  for (std::size_t w = 0; w < connections.size(); w++) {
+    dispatch(w);
+    dispatch(w);
+  }
+
+  std::vector<pollfd> polls(connections.size());
+  std::vector<char> payload;
+  std::size_t outstanding = 0;
+
+  for (int n : inFlight) outstanding += n;
+
+  while (outstanding > 0) {
+    for (std::size_t w = 0; w < connections.size(); w++) {
+      polls[w] = {connections[w], short(inFlight[w] > 0 ? POLLIN : 0), 0};
+    }
+
+    if (poll(polls.data(), polls.size(), -1) < 0) {
+      if (errno == EINTR) continue;
+      throw std::string("Shard poll failed: ") + std::strerror(errno);
+    }
+
+    for (std::size_t w = 0; w < connections.size(); w++) {
+      if (!(polls[w].revents & (POLLIN | POLLHUP | POLLERR))) continue;
+
+      Header header = receiveMessage(connections[w], payload);
+
+      if (header.type != Message::result) {
+        throw std::string("Unexpected message from shard worker");
+      }
+
+      std::size_t at = 0;
+      std::uint64_t begin = unpack<std::uint64_t>(payload, at);
+      std::uint64_t end = unpack<std::uint64_t>(payload, at);
+
+      if (end > values.size() || begin > end) {
+        throw std::string("Shard worker returned a tile out of range");
+      }
+
+      for (std::uint64_t offset = begin; offset < end; offset++) {
+        values[offset] = unpack<cluster::data_t>(payload, at);
+      }
+
+      inFlight[w]--;
+      outstanding--;
+
+      if (!pending.empty()) {
+        dispatch(w);
+        outstanding++;
+      }
+    }
+  }
+
+  for (int fd : connections) {
+    sendMessage(fd, Message::stop, {});
+  }
+
+  return distances;
+}
+
+cluster::DistanceMatrix cluster::shard::pairwise(
+  const cluster::Dataset& data,
+  cluster::dist::DistanceMeasure dist,
+  unsigned int workers,
+  std::size_t tileSize
+) {
+  std::vector<int> connections;
+  std::vector<pid_t> children;
+
+  auto cleanUp = [&](bool kill) {
+    for (int fd : connections) close(fd);
+    for (pid_t child : children) {
+      if (kill) ::kill(child, SIGTERM);
+      waitpid(child, nullptr, 0);
+    }
+  };
+
+  try {
+    for (unsigned int w = 0; w < std::max(workers, 1u); w++) {
+      int ends[2];
+
+      if (socketpair(AF_UNIX, SOCK_STREAM, 0, ends) < 0) {
+        throw std::string("Can't connect a shard worker: ") +
+          std::strerror(errno);
+      }
+
+      pid_t child = fork();
+
+      if (child < 0) {
+        close(ends[0]);
+        close(ends[1]);
+        throw std::string("Can't start a shard worker: ") + std::strerror(errno);
+      }
+
+      if (child == 0) {
+        // Drop the coordinator's ends, including earlier workers'.
+        for (int fd : connections) close(fd);
+        close(ends[0]);
+
+        try {
+          cluster::shard::serve(ends[1]);
+        } catch (...) {
+          _exit(1);
+        }
+
+        _exit(0);
+      }
+
+      close(ends[1]);
+      connections.push_back(ends[0]);
+      children.push_back(child);
+    }
+
+    cluster::DistanceMatrix distances = cluster::shard::pairwise(
+      data, dist, connections, tileSize
+    );
+    cleanUp(false);
+    return distances;
+  } catch (...) {
+    cleanUp(true);
+    throw;
+  }
+}
@@ -0,0 +1,87 @@
+#ifndef SPAN_H
+#define SPAN_H
+
+#include "ns.hpp"
+
+#include <cstddef>
+#include <initializer_list>
+#include <iterator>
+#include <type_traits>
+#include <vector>
+
+// A non-owning view of n values spaced `stride` apart in memory, so a
+// dataset's rows and columns can be handed out without copying them.
+template <class T>
+class cluster::span {
+public:
+  class iterator {
+  private:
+    T* ptr;
+    std::ptrdiff_t step;
+
+  public:
+    using iterator_category = std::forward_iterator_tag;
+    using value_type = std::remove_const_t<T>;
+    using difference_type = std::ptrdiff_t;
+    using pointer = T*;
+    using reference = T&;
+
+    iterator(T* ptr, std::ptrdiff_t step) : ptr(ptr), step(step) {}
+
+    T& operator * () const { return *ptr; }
+    iterator& operator ++ () { ptr += step; return *this; }
+    iterator operator ++ (int) { iterator old = *this; ptr += step; return old; }
+    bool operator == (const iterator& other) const { return ptr == other.ptr; }
+    bool operator != (const iterator& other) const { return ptr != other.ptr; }
+  };
+
+private:
+  T* ptr;
+  std::size_t length;
+  std::ptrdiff_t step;
+
+public:
+  span() : ptr(nullptr), length(0), step(1) {}
+
+  span(T* ptr, std::size_t length, std::ptrdiff_t step = 1)
+  : ptr(ptr), length(length), step(step) {}
+
+  // Vectors convert implicitly, so code holding a std::vector can still call
+  // anything taking a span.
+  template <
+    class U,
+    class = std::enable_if_t<std::is_same_v<std::remove_const_t<T>, U>>
+  >
+  span(const std::vector<U>& vec) : span(vec.data(), vec.size()) {}
+
+  template <
+    class U,
+    class = std::enable_if_t<std::is_same_v<T, U>>
+  >
+  span(std::vector<U>& vec) : span(vec.data(), vec.size()) {}
+
+  // So can braced lists of values, for the length of the call they're
+  // passed to.
+  span(std::initializer_list<std::remove_const_t<T>> list)
+  : span(list.begin(), list.size()) {}
+
+  // Spans of mutable values can be read as spans of const ones.
+  operator span<const T> () const { return span<const T>(ptr, length, step); }
+
+  std::size_t size() const { return length; }
+  bool empty() const { return length == 0; }
+  std::ptrdiff_t stride() const { return step; }
+  bool contiguous() const { return step == 1; }
+  T* data() const { return ptr; }
+
+  T& operator [] (std::size_t i) const { return ptr[i * step]; }
+
+  iterator begin() const { return iterator(ptr, step); }
+  iterator end() const { return iterator(ptr + (std::ptrdiff_t)length * step, step); }
+
+  std::vector<std::remove_const_t<T>> toVector() const {
+    return std::vector<std::remove_const_t<T>>(begin(), end());
+  }
+};
+
+#endif
@@ -1,9 +1,13 @@
 #include "ns.hpp"
+#include "Dataset.hpp"
+#include "Exec.hpp"
+#include "Span.hpp"
 
 #include <vector>
 #include <cmath>
+#include <utility>
 
-cluster::data_t cluster::stat::mean(std::vector<cluster::data_t> data) {
+cluster::data_t cluster::stat::mean(cluster::span<const cluster::data_t> data) {
   cluster::data_t sum = 0;
 
   for (auto d : data) sum += d;
@@ -12,8 +16,8 @@ cluster::data_t cluster::stat::mean(std::vector<cluster::data_t> data) {
 }
 
 cluster::data_t cluster::stat::cov(
-  std::vector<cluster::data_t> x,
-  std::vector<cluster::data_t> y
+  cluster::span<const cluster::data_t> x,
+  cluster::span<const cluster::data_t> y
 ) {
   cluster::data_t mx = cluster::stat::mean(x);
   cluster::data_t my = cluster::stat::mean(y);
@@ -30,10 +34,143 @@ cluster::data_t cluster::stat::cov(
   return sum / (x.size() - 1);
 }
 
-cluster::data_t cluster::stat::var(std::vector<cluster::data_t> data) {
+cluster::data_t cluster::stat::var(cluster::span<const cluster::data_t> data) {
   return cluster::stat::cov(data, data);
 }
 
-cluster::data_t cluster::stat::sd(std::vector<cluster::data_t> data) {
+cluster::data_t cluster::stat::sd(cluster::span<const cluster::data_t> data) {
   return sqrt(cluster::stat::var(data));
 }
+
+cluster::data_t cluster::stat::mean(
+  cluster::span<const cluster::data_t> data,
+  cluster::span<const cluster::data_t> weights
+) {
+  cluster::data_t sum = 0;
+  cluster::data_t total = 0;
+
+  for (
+    auto id = data.begin(), iw = weights.begin();
+    id != data.end();
+    ++id, ++iw
+  ) {
+    sum += *iw * *id;
+    total += *iw;
+  }
+
+  return sum / total;
+}
+
+cluster::data_t cluster::stat::cov(
+  cluster::span<const cluster::data_t> x,
+  cluster::span<const cluster::data_t> y,
+  cluster::span<const cluster::data_t> weights
+) {
+  cluster::data_t mx = cluster::stat::mean(x, weights);
+  cluster::data_t my = cluster::stat::mean(y, weights);
+  cluster::data_t sum = 0;
+  cluster::data_t total = 0;
+
+  for (
+    auto ix = x.begin(), iy = y.begin(), iw = weights.begin();
+    ix != x.end();
+    ++ix, ++iy, ++iw
+  ) {
+    sum += *iw * (*ix - mx)*(*iy - my);
+    total += *iw;
+  }
+
+  return sum / (total - 1);
+}
+
+cluster::data_t cluster::stat::var(
+  cluster::span<const cluster::data_t> data,
+  cluster::span<const cluster::data_t> weights
+) {
+  return cluster::stat::cov(data, data, weights);
+}
+
+cluster::data_t cluster::stat::sd(
+  cluster::span<const cluster::data_t> data,
+  cluster::span<const cluster::data_t> weights
+) {
+  return sqrt(cluster::stat::var(data, weights));
+}
+
+std::vector<cluster::data_t> cluster::stat::covariance(
+  const cluster::Dataset& data,
+  cluster::exec::Policy policy
+) {
+  cluster::index_t n = data.nObs();
+  cluster::index_t d = data.nVars();
+  auto weights = data.weights();
+  auto means = data.weighted()
+    ? data.applyColWeighted(cluster::stat::mean, policy)
+    : data.applyCol(cluster::stat::mean, policy);
+
+  // Centre each column (scaled by the root of its row's weight) into one
+  // contiguous buffer, so every entry is a plain dot product.
+  std::vector<cluster::data_t> centred((std::size_t)d * n);
+
+  cluster::exec::parallelFor(
+    n,
+    policy,
+    [&](std::size_t begin, std::size_t end, unsigned int) {
+      for (std::size_t i = begin; i < end; i++) {
+        auto row = data[i];
+        cluster::data_t scale = sqrt(weights[i]);
+
+        for (cluster::index_t v = 0; v < d; v++) {
+          centred[(std::size_t)v * n + i] = scale * (row[v] - means[v]);
+        }
+      }
+    }
+  );
+
+  cluster::data_t total = 0;
+  for (auto w : weights) total += w;
+
+  // Fill the upper triangle a tile of variables at a time, then mirror it.
+  const cluster::index_t tile = 32;
+  std::vector<std::pair<cluster::index_t, cluster::index_t>> tiles;
+
+  for (cluster::index_t a = 0; a < d; a += tile) {
+    for (cluster::index_t b = a; b < d; b += tile) {
+      tiles.push_back({a, b});
+    }
+  }
+
+  std::vector<cluster::data_t> cov((std::size_t)d * d);
+
+  cluster::exec::parallelFor(
+    tiles.size(),
+    policy,
+    [&](std::size_t begin, std::size_t end, unsigned int) {
+      for (std::size_t t = begin; t < end; t++) {
+        cluster::index_t aEnd = std::min(d, tiles[t].first + tile);
+        cluster::index_t bEnd = std::min(d, tiles[t].second + tile);
+
+        for (cluster::index_t a = tiles[t].first; a < aEnd; a++) {
+          const cluster::data_t* x = &centred[(std::size_t)a * n];
+
+          cluster::index_t b = std::max(a, tiles[t].second);
+
+          for (; b < bEnd; b++) {
+            const cluster::data_t* y = &centred[(std::size_t)b * n];
+            cluster::data_t sum = 0;
+
+            for (cluster::index_t i = 0; i < n; i++) {
+              sum += x[i] * y[i];
+            }
+
+            cov[(std::size_t)a * d + b] = cov[(std::size_t)b * d + a] =
+              sum / (total - 1);
+          }
+        }
+      }
+    },
+    1
+  );
+
+  return cov;
+}
@@ -1,14 +1,40 @@
 #include "ns.hpp"
 #include "Dataset.hpp"
+#include "Batch.hpp"
+#include "Checkpoint.hpp"
+#include "Dendrogram.hpp"
+#include "DistanceMatrix.hpp"
+#include "IncrementalHierarchy.hpp"
+#include "Mahalanobis.hpp"
+#include "Plan.hpp"
+#include "Projection.hpp"
 using namespace cluster;
 
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
 #include <iostream>
 #include <vector>
 #include <sstream>
 
+#include <unistd.h>
+
 void tests();
 void testDataset();
+void testViews();
 void testDistMeasures();
+void testEvaluation();
+void testWeights();
+void testIncremental();
+void testSharding();
+void testProjection();
+void testMahalanobis();
+void testBatch();
+void testCheckpoint();
+void testAllocations();
+void testPlanner();
+Dataset sampleCounts();
 void testClustering(
   dist::DistanceMeasure dist,
   agg::Linkage linkage,
@@ -28,8 +54,30 @@ int main(int argc, char** argv) {
 void tests() {
   testDataset();
 
+  testViews();
+
   testDistMeasures();
 
+  testEvaluation();
+
+  testWeights();
+
+  testIncremental();
+
+  testSharding();
+
+  testProjection();
+
+  testMahalanobis();
+
+  testBatch();
+
+  testCheckpoint();
+
+  testAllocations();
+
+  testPlanner();
+
   testClustering(
     dist::euclidean,
     agg::lSingle,
@@ -96,6 +144,41 @@ void testDataset() {
             << vectorToString(d4("Age")) << "\n"
             << vectorToString(d4.applyCol(stat::mean)) << "\n"
             << vectorToString(d4.applyCol(stat::sd)) << std::endl;
+
+  // Every execution policy should agree with the serial results above.
+  exec::setConcurrency(4);
+  std::cout << vectorToString(d4.applyCol(stat::sd, exec::Policy::threads))
+            << "\n"
+            << vectorToString(d4.applyCol(stat::sd, exec::Policy::vectorized))
+            << "\n"
+            << vectorToString(d2.applyRow(stat::mean, exec::Policy::threads))
+            << std::endl;
+  exec::setConcurrency(0);
+}
+
+void testViews() {
+  Dataset d1({"a", "b", "c"});
+
+  d1 += {
+    {1, 2, 3},
+    {4, 5, 6},
+    {7, 8, 9},
+    {10, 11, 12}
+  };
+
+  // Views share d1's storage until they're materialized or added to.
+  Dataset evens = d1.slice(0, 4, 2);
+  Dataset corner = evens(std::vector<std::string>{"c", "a"})[std::vector<unsigned>{1}];
+  Dataset both = d1[std::vector<unsigned>{3}] + d1[std::vector<unsigned>{0}];
+  Dataset copy = both.materialize();
+  copy += {0, 0, 0};
+
+  std::cout << evens.isView() << " " << evens.nObs() << "\n"
+            << vectorToString(evens("b")) << "\n"
+            << vectorToString(corner[0]) << "\n"
+            << both.isView() << " " << vectorToString(both("a")) << "\n"
+            << copy.isView() << " " << copy.nObs() << " " << both.nObs()
+            << std::endl;
 }
 
 void testDistMeasures() {
@@ -103,11 +186,406 @@ void testDistMeasures() {
   std::cout << dist::manhattan({1, 2, 3}, {4, 3, 2}) << std::endl;
 }
 
-void testClustering(
+void testEvaluation() {
+  Dataset d1 = sampleCounts();
+  DistanceMatrix distances = dist::pairwise(d1, dist::euclidean);
+  agg::Dendrogram tree = agg::hierarchy(d1, dist::euclidean, agg::lAverage);
+  auto labels = tree.cut(3);
+
+  // The exact silhouette should match whether computed from the data, from
+  // the distance matrix, or from a "sample" of every observation.
+  std::cout << vectorToString(labels) << "\n"
+            << eval::silhouette(d1, labels) << " "
+            << eval::silhouette(distances, labels) << " "
+            << eval::sampledSilhouette(d1, labels, d1.nObs()) << "\n"
+            << eval::calinskiHarabasz(d1, labels) << " "
+            << eval::daviesBouldin(d1, labels) << " "
+            << eval::copheneticCorrelation(tree, distances) << "\n"
+            << std::endl;
+
+  try {
+    eval::sampledSilhouette(d1, labels, 0);
+  } catch (const std::string& error) {
+    std::cout << error << std::endl;
+  }
+}
+
+void testWeights() {
+  Dataset expanded = sampleCounts();
+  expanded += {
+    {3, 2, 0, 0},
+    {3, 3, 3, 3},
+    {1, 1, 0, 1},
+    {3, 2, 0, 0}
+  };
+
+  std::vector<Dataset::index_t> groups;
+  Dataset collapsed = expanded.collapse(&groups);
+
+  // Weighted statistics of the collapsed data should match the expanded data.
+  std::cout << collapsed.nObs() << " " << collapsed.totalWeight() << "\n"
+            << vectorToString(collapsed.weights()) << "\n"
+            << vectorToString(groups) << "\n"
+            << vectorToString(expanded.applyCol(stat::sd)) << "\n"
+            << vectorToString(collapsed.applyColWeighted(stat::sd)) << "\n"
+            << agg::lWards(dist::euclidean, collapsed.slice(0, 2),
+                 collapsed.slice(8, 10)) << " "
+            << agg::lWards(dist::euclidean,
+                 expanded[std::vector<unsigned>{0, 1, 10, 12, 13}],
+                 expanded[std::vector<unsigned>{8, 9, 11}])
+            << std::endl;
+}
+
+void testIncremental() {
+  Dataset d1 = sampleCounts();
+  Dataset history = d1.slice(0, 8);
+  agg::IncrementalHierarchy tree(
+    history,
+    agg::hierarchy(history, dist::euclidean, agg::lCentroid),
+    dist::euclidean,
+    agg::lCentroid
+  );
+
+  // One row far from the rest gets grafted; a repeat of an old row joins
+  // the cluster it already belongs to.
+  Dataset daily(4);
+  daily += {
+    {3, 3, 3, 3},
+    {1, 0, 1, 2}
+  };
+
+  auto report = tree.insert(daily, 0.5);
+
+  std::cout << report.absorbed << " " << report.grafted << " "
+            << report.inversions << " " << report.rebuild << "\n"
+            << tree.nObs() << " " << vectorToString(tree.cut(3)) << "\n"
+            << tree.insert(d1.slice(8, 10)).rebuild << std::endl;
+
+  // Duplicate rows merge at height 0, level with the leaves; cutting has to
+  // split those merges rather than the leaves themselves.
+  Dataset duplicates(2);
+  duplicates += {
+    {0, 0},
+    {0, 0},
+    {0, 0},
+    {5, 5}
+  };
+  agg::IncrementalHierarchy flat(
+    duplicates,
+    agg::hierarchy(duplicates, dist::euclidean, agg::lCentroid),
+    dist::euclidean,
+    agg::lCentroid
+  );
+
+  std::cout << vectorToString(flat.cut(3)) << " "
+            << vectorToString(flat.cut(4)) << std::endl;
+}
+
+void testSharding() {
+  Dataset d1 = sampleCounts();
+
+  // Two local worker processes, with tiles small enough that both get work.
+  DistanceMatrix local = dist::pairwise(d1, dist::euclidean);
+  DistanceMatrix sharded = shard::pairwise(d1, dist::euclidean, 2, 8);
+  agg::Dendrogram tree = agg::lanceWilliams(sharded, agg::lWards);
+
+  std::cout << (local.condensed() == sharded.condensed()) << "\n"
+            << vectorToString(tree.cut(4)) << "\n"
+            << vectorToString(
+                 agg::hierarchy(d1, dist::euclidean, agg::lWards).cut(4)
+               ) << std::endl;
+}
+
+void testProjection() {
+  Dataset d1 = sampleCounts();
+
+  // Exact and randomized PCA should agree when keeping every component.
+  Projection exact = Projection::pca(d1, 2);
+  Projection randomized = Projection::randomizedPca(d1, 2, 2);
+  Projection enough = Projection::pcaExplaining(d1, 0.9);
+  Dataset later(4);
+  later += {2, 2, 1, 1};
+
+  std::cout << vectorToString(exact.explainedVariance()) << "\n"
+            << vectorToString(randomized.explainedVariance()) << "\n"
+            << enough.outputDims() << " "
+            << exact.transform(later).nVars() << " "
+            << Projection::sparseRandom(4, 2).transform(d1).nObs()
+            << std::endl;
+}
+
+void testMahalanobis() {
+  Dataset d1 = sampleCounts();
+  dist::Mahalanobis mahalanobis(d1);
+  Dataset whitened = mahalanobis.whiten(d1);
+
+  // Euclidean distance between whitened rows is the Mahalanobis distance,
+  // and with one variable it's just the distance in standard deviations.
+  Dataset dogs = d1.cols(std::vector<std::string>{"dogs"});
+
+  std::cout << mahalanobis(d1[0], d1[1]) << " "
+            << dist::euclidean(whitened[0], whitened[1]) << "\n"
+            << dist::Mahalanobis(dogs)(dogs[0], dogs[1]) << " "
+            << 2 / stat::sd(dogs("dogs")) << "\n"
+            << vectorToString(agg::hierarchy(
+                 whitened, dist::euclidean, agg::lAverage
+               ).cut(3)) << std::endl;
+}
+
+void testBatch() {
+  Dataset d1 = sampleCounts();
+
+  // One row per metric and linkage, one line of labels per k.
+  auto results = agg::batch(
+    d1,
+    {dist::euclidean, dist::manhattan},
+    {agg::lSingle, agg::lComplete, agg::lAverage, agg::lCentroid, agg::lWards},
+    {3, 4}
+  );
+
+  for (auto& result : results) {
+    std::cout << dist::nameOf(result.dist) << "\n";
+
+    for (auto& labels : result.labels) {
+      std::cout << vectorToString(labels) << "\n";
+    }
+  }
+
+  // Linkages queueing up for a single copy of the matrix at a time, on
+  // several threads, get the same results.
+  exec::setConcurrency(4);
+  auto queued = agg::batch(
+    d1,
+    {dist::euclidean, dist::manhattan},
+    {agg::lSingle, agg::lComplete, agg::lAverage, agg::lCentroid, agg::lWards},
+    {3, 4},
+    exec::Policy::threads,
+    1
+  );
+  exec::setConcurrency(0);
+  bool same = queued.size() == results.size();
+
+  for (std::size_t r = 0; same && r < results.size(); r++) {
+    same = queued[r].labels == results[r].labels;
+  }
+
+  std::cout << same << "\n";
+
+  // Weighted rows should merge just as they do in hierarchy().
+  Dataset expanded = sampleCounts();
+  expanded += {
+    {3, 2, 0, 0},
+    {3, 3, 3, 3},
+    {1, 1, 0, 1},
+    {3, 2, 0, 0}
+  };
+  Dataset collapsed = expanded.collapse();
+
+  for (auto& result : agg::batch(collapsed, {dist::euclidean},
+      {agg::lAverage, agg::lCentroid, agg::lWards}, {3})) {
+    auto tree = agg::hierarchy(collapsed, result.dist, result.linkage);
+    std::cout << (tree.cut(3) == result.labels[0]) << " ";
+  }
+
+  std::cout << std::endl;
+}
+
+// Average linkage that gives up after a set number of calls, as if the run
+// had been killed part way through.
+static long linkageCallsLeft = -1;
+
+static long double interruptible(
   dist::DistanceMeasure dist,
-  agg::Linkage linkage,
-  agg::StopCriteria stop
+  const Dataset& cluster1,
+  const Dataset& cluster2
 ) {
+  if (linkageCallsLeft == 0) {
+    throw std::string("interrupted");
+  }
+
+  linkageCallsLeft--;
+  return agg::lAverage(dist, cluster1, cluster2);
+}
+
+void testCheckpoint() {
+  Dataset d1 = sampleCounts();
+  char path[] = "/tmp/classify-checkpoint-XXXXXX";
+  int fd = mkstemp(path);
+
+  if (fd < 0) {
+    std::cout << "skipped" << std::endl;
+    return;
+  }
+
+  // Only the name is wanted; a run starts from scratch when there's no file.
+  close(fd);
+  std::remove(path);
+  agg::Checkpoint checkpoint(path, 2);
+  auto exists = [&]() { return std::ifstream(path).good(); };
+  auto interrupt = [&](long calls, std::function<void()> run) {
+    linkageCallsLeft = calls;
+
+    try {
+      run();
+    } catch (const std::string&) {}
+
+    linkageCallsLeft = -1;
+  };
+
+  // A run interrupted part way through picks up from its last snapshot and
+  // ends up with the same tree as one that ran straight through. Once it's
+  // done, the snapshot is gone.
+  auto straight = agg::hierarchy(d1, dist::euclidean, interruptible);
+  interrupt(85, [&]() {
+    agg::hierarchy(d1, dist::euclidean, interruptible, checkpoint);
+  });
+  checkpoint.finish();
+  bool interrupted = exists();
+  auto resumed = agg::hierarchy(d1, dist::euclidean, interruptible, checkpoint);
+  bool same = straight.steps().size() == resumed.steps().size();
+
+  for (std::size_t t = 0; same && t < straight.steps().size(); t++) {
+    auto& a = straight.steps()[t];
+    auto& b = resumed.steps()[t];
+    same = a.left == b.left && a.right == b.right && a.height == b.height;
+  }
+
+  std::cout << interrupted << " " << same << " " << exists() << " "
+            << vectorToString(resumed.cut(3)) << std::endl;
+
+  // A run that stops at 8 clusters can't carry on from one interrupted
+  // after merging further than that, and nor can another linkage. The first
+  // snapshot is taken at 7 clusters, so there's at least that one.
+  agg::Checkpoint flat(path, 3);
+  interrupt(96, [&]() {
+    agg::agglomerativeClustering(
+      d1, dist::euclidean, interruptible, agg::nClusters<2>, flat
+    );
+  });
+  flat.finish();
+
+  for (auto linkage : {interruptible, agg::lCentroid}) {
+    try {
+      agg::agglomerativeClustering(
+        d1, dist::euclidean, linkage, agg::nClusters<8>, flat
+      );
+      std::cout << "resumed past the stop" << std::endl;
+    } catch (const std::string& error) {
+      std::cout << error.substr(0, error.find(':')) << std::endl;
+    }
+  }
+
+  std::remove(path);
+}
+
+// Merges that allocated, once the first couple have warmed up any reusable
+// buffers. Counted between calls of the stop criterion.
+static std::size_t mergesAllocating = 0;
+
+static bool countAllocations(const std::vector<Dataset>& clusters) {
+  static std::size_t last = 0;
+  std::size_t now = alloc::count();
+
+  if (clusters.size() < 8 && now != last) {
+    mergesAllocating++;
+  }
+
+  last = now;
+  return false;
+}
+
+void testAllocations() {
+  // Allocations are only counted in builds with COUNT_ALLOCATIONS defined.
+  if (!alloc::counting()) {
+    std::cout << "skipped" << std::endl;
+    return;
+  }
+
+  Dataset d1 = sampleCounts();
+  Dataset view = d1.slice(1, 10)(std::vector<unsigned>{0, 1, 3});
+
+  // Neither the data nor a view of it should allocate once merging is going.
+  for (const Dataset& data : {d1, view}) {
+    for (auto linkage : {agg::lSingle, agg::lComplete, agg::lAverage,
+        agg::lCentroid, agg::lWards}) {
+      mergesAllocating = 0;
+      agg::agglomerativeClustering(
+        data, dist::euclidean, linkage, countAllocations, exec::Policy::serial
+      );
+      std::cout << mergesAllocating << " ";
+    }
+  }
+
+  std::cout << std::endl;
+}
+
+void testPlanner() {
+  Dataset d1 = sampleCounts();
+  agg::Budget unlimited;
+  agg::Budget tiny;
+  tiny.memory = 1;
+
+  // Whichever exact strategy gets picked, the clusters are the same.
+  std::cout << vectorToString(
+               agg::planned(d1, dist::euclidean, agg::lAverage, 3, unlimited)
+             ) << "\n"
+            << agg::Plan::nameOf(
+                 agg::plan(d1, dist::manhattan, agg::lCentroid, unlimited).strategy
+               ) << std::endl;
+
+  // Weighted rows count for their weight whichever strategy is picked. Lower
+  // down, merges tie at the same height and either order is right, so only
+  // the top of the tree is compared.
+  Dataset weighted = d1;
+  weighted.add({3, 3, 2, 3}, 20);
+  weighted.add({2, 1, 1, 1}, 6);
+  weighted.add({1, 0, 2, 2}, 8);
+
+  for (auto linkage : {agg::lAverage, agg::lCentroid, agg::lWards}) {
+    auto tree = agg::hierarchy(weighted, dist::euclidean, linkage);
+    bool same = true;
+
+    for (Dataset::index_t k = 1; k <= 6; k++) {
+      same = same && tree.cut(k) ==
+        agg::planned(weighted, dist::euclidean, linkage, k, unlimited);
+    }
+
+    std::cout << same << " ";
+  }
+
+  std::cout << std::endl;
+
+  // With enough rows, threads pay off for built-in linkages, but custom ones
+  // aren't known to be thread-safe and are planned serially.
+  Dataset many(4);
+
+  for (int i = 0; i < 2000; i++) {
+    many.add({(data_t)(i % 7), (data_t)(i % 11), (data_t)(i % 13), 1});
+  }
+
+  exec::setConcurrency(8);
+
+  for (auto linkage : {agg::lAverage, interruptible}) {
+    auto plan = agg::plan(many, dist::euclidean, linkage, unlimited);
+
+    for (auto& estimate : plan.estimates) {
+      if (estimate.strategy == agg::Plan::Strategy::generic) {
+        std::cout << estimate.threads << " ";
+      }
+    }
+  }
+
+  std::cout << std::endl;
+  exec::setConcurrency(0);
+
+  try {
+    agg::plan(d1, dist::euclidean, agg::lAverage, tiny);
+  } catch (std::string error) {
+    std::cout << error.substr(0, error.find('\n')) << std::endl;
+  }
+}
+
+Dataset sampleCounts() {
   Dataset d1({"dogs", "cats", "turtles", "fish"});
 
   d1 += {
@@ -123,6 +601,16 @@ void testClustering(
     {4, 0, 0, 0}
   };
 
+  return d1;
+}
+
+void testClustering(
+  dist::DistanceMeasure dist,
+  agg::Linkage linkage,
+  agg::StopCriteria stop
+) {
+  Dataset d1 = sampleCounts();
+
   auto result = agg::agglomerativeClustering(
     d1,
     dist,
@@ -1,23 +1,70 @@
 #ifndef NS_H
 #define NS_H
 
+#include <cstddef>
+#include <iosfwd>
+#include <string>
 #include <vector>
 
 namespace cluster {
   using data_t = long double;
+  using index_t = unsigned int;
   class Dataset;
+  class DistanceMatrix;
+  class Projection;
+
+  template <class T>
+  class span;
+
+  namespace exec {
+    // How bulk operations are carried out: on the calling thread, across
+    // exec::concurrency() threads, or on the calling thread over contiguous
+    // blocks the compiler can vectorize.
+    enum class Policy { serial, threads, vectorized };
+
+    unsigned int concurrency();
+    void setConcurrency(unsigned int threads);
+  }
+
+  namespace alloc {
+    // Heap allocations made by the whole program so far. They're only
+    // counted in builds with COUNT_ALLOCATIONS defined (e.g. make compile
+    // DEBUG=-DCOUNT_ALLOCATIONS); otherwise count() stays at 0.
+    bool counting();
+    std::size_t count();
+  }
 
   namespace stat {
-    data_t mean(std::vector<data_t> data);
-    data_t cov(std::vector<data_t> x, std::vector<data_t> y);
-    data_t var(std::vector<data_t> data);
-    data_t sd(std::vector<data_t> data);
+    data_t mean(span<const data_t> data);
+    data_t cov(span<const data_t> x, span<const data_t> y);
+    data_t var(span<const data_t> data);
+    data_t sd(span<const data_t> data);
+
+    // Weighted versions treat the weights as frequencies, so they agree with
+    // the unweighted ones applied to the expanded data.
+    data_t mean(span<const data_t> data, span<const data_t> weights);
+    data_t cov(
+      span<const data_t> x,
+      span<const data_t> y,
+      span<const data_t> weights
+    );
+    data_t var(span<const data_t> data, span<const data_t> weights);
+    data_t sd(span<const data_t> data, span<const data_t> weights);
+
+    // The covariance of every pair of data's variables, as cov() (or its
+    // weighted version) would give it, in a row-major nVars x nVars matrix.
+    std::vector<data_t> covariance(
+      const Dataset& data,
+      exec::Policy policy = exec::Policy::threads
+    );
   }
 
   namespace dist {
+    class Mahalanobis;
+
     using DistanceMeasure = long double (
-      std::vector<data_t> x,
-      std::vector<data_t> y
+      span<const data_t> x,
+      span<const data_t> y
     );
 
     DistanceMeasure euclidean;
@@ -25,9 +72,28 @@ namespace cluster {
     DistanceMeasure minkowski;
     DistanceMeasure maximum;
     DistanceMeasure canberra;
+
+    // Look the built-in measures up by name, for passing them between
+    // processes. byName() returns nullptr and nameOf() "" if unknown.
+    DistanceMeasure* byName(const std::string& name);
+    std::string nameOf(DistanceMeasure* dist);
+
+    // Every pairwise distance between the observations of data.
+    DistanceMatrix pairwise(
+      const Dataset& data,
+      DistanceMeasure dist,
+      exec::Policy policy = exec::Policy::threads
+    );
   };
 
   namespace agg {
+    class Checkpoint;
+    class Dendrogram;
+    class IncrementalHierarchy;
+    struct BatchResult;
+    struct Budget;
+    struct Plan;
+
     using Linkage = long double (
       dist::DistanceMeasure dist,
       const Dataset& cluster1,
@@ -40,22 +106,205 @@ namespace cluster {
     Linkage lCentroid;
     Linkage lWards;
 
-    using StopCriteria = bool (std::vector<Dataset> clusters);
+    // The clusters a linkage or stop criterion is handed are views that only
+    // last until the next merge; copy them with materialize() to keep them.
+    using StopCriteria = bool (const std::vector<Dataset>& clusters);
 
     template <unsigned int n>
     StopCriteria nClusters;
 
+    // These run serially unless asked otherwise. Under Policy::threads the
+    // linkage and distance are called from several threads at once, so
+    // custom ones must be safe to call concurrently.
     std::vector<Dataset> agglomerativeClustering(
       const Dataset& data,
       dist::DistanceMeasure dist,
       Linkage linkage,
-      StopCriteria stop
+      StopCriteria stop,
+      exec::Policy policy = exec::Policy::serial
     );
+
+    // As above, snapshotting progress to checkpoint as it goes and resuming
+    // from its latest snapshot if there is one.
+    std::vector<Dataset> agglomerativeClustering(
+      const Dataset& data,
+      dist::DistanceMeasure dist,
+      Linkage linkage,
+      StopCriteria stop,
+      Checkpoint& checkpoint,
+      exec::Policy policy = exec::Policy::serial
+    );
+
+    // Merge from a precomputed distance matrix with the Lance-Williams update
+    // of one of the built-in linkages. lCentroid and lWards expect euclidean
+    // distances. The matrix is updated in place, so pass one that's no longer
+    // needed as an rvalue to save copying it.
+    Dendrogram lanceWilliams(
+      DistanceMatrix distances,
+      Linkage linkage,
+      exec::Policy policy = exec::Policy::threads
+    );
+
+    // The same for weighted observations, with weights[i] the weight of row
+    // i. As in the linkages themselves, a cluster counts for its total
+    // weight rather than its number of rows.
+    Dendrogram lanceWilliams(
+      DistanceMatrix distances,
+      const std::vector<data_t>& weights,
+      Linkage linkage,
+      exec::Policy policy = exec::Policy::threads
+    );
+
+    // Cluster data under every combination of metric and linkage, cutting
+    // each tree into every k in ks. Each metric's distance matrix is computed
+    // once, and its linkages run in parallel. Merging overwrites a matrix, so
+    // each linkage works on its own copy, except the last one to start,
+    // which takes the original. At most maxCopies copies exist at a time on
+    // top of the original (0 means one per thread), and linkages wait for
+    // one to be freed.
+    std::vector<BatchResult> batch(
+      const Dataset& data,
+      const std::vector<dist::DistanceMeasure*>& metrics,
+      const std::vector<Linkage*>& linkages,
+      const std::vector<index_t>& ks,
+      exec::Policy policy = exec::Policy::threads,
+      std::size_t maxCopies = 0
+    );
+
+    // Merge all the way down to one cluster, recording every merge.
+    Dendrogram hierarchy(
+      const Dataset& data,
+      dist::DistanceMeasure dist,
+      Linkage linkage,
+      exec::Policy policy = exec::Policy::serial
+    );
+
+    Dendrogram hierarchy(
+      const Dataset& data,
+      dist::DistanceMeasure dist,
+      Linkage linkage,
+      Checkpoint& checkpoint,
+      exec::Policy policy = exec::Policy::serial
+    );
+
+    // Estimate what each way of clustering data would cost and pick the
+    // fastest that fits in budget, along with whether to use threads for it.
+    // Throws if nothing fits.
+    Plan plan(
+      const Dataset& data,
+      dist::DistanceMeasure dist,
+      Linkage linkage,
+      const Budget& budget
+    );
+
+    // Cluster data into k clusters the way plan says to, writing the plan
+    // and how long it really took to log if given. Labels are numbered like
+    // Dendrogram::cut().
+    std::vector<index_t> planned(
+      const Dataset& data,
+      dist::DistanceMeasure dist,
+      Linkage linkage,
+      index_t k,
+      const Plan& plan,
+      std::ostream* log = nullptr
+    );
+    std::vector<index_t> planned(
+      const Dataset& data,
+      dist::DistanceMeasure dist,
+      Linkage linkage,
+      index_t k,
+      const Budget& budget,
+      std::ostream* log = nullptr
+    );
+
+    std::ostream& operator << (std::ostream& out, const Plan& plan);
   };
+
+  namespace shard {
+    // Compute a distance matrix in tiles of consecutive entries, handed out
+    // to worker processes. The first version forks its own workers, talking
+    // to them over Unix sockets; the second drives workers that are already
+    // connected (on this machine or another one with the same data layout)
+    // and running serve().
+    DistanceMatrix pairwise(
+      const Dataset& data,
+      dist::DistanceMeasure dist,
+      unsigned int workers,
+      std::size_t tileSize = 1 << 16
+    );
+    DistanceMatrix pairwise(
+      const Dataset& data,
+      dist::DistanceMeasure dist,
+      const std::vector<int>& connections,
+      std::size_t tileSize = 1 << 16
+    );
+
+    // Answer a coordinator's requests on fd until it's done.
+    void serve(int fd);
+  }
+
+  namespace eval {
+    // Cluster labels for each observation, numbered from 0 (as produced by
+    // Dendrogram::cut()).
+    using Labels = std::vector<index_t>;
+
+    // Silhouette widths, either computed straight from the data or read
+    // from an existing distance matrix.
+    std::vector<data_t> silhouettes(
+      const Dataset& data,
+      const Labels& labels,
+      dist::DistanceMeasure dist = dist::euclidean,
+      exec::Policy policy = exec::Policy::threads
+    );
+    std::vector<data_t> silhouettes(
+      const DistanceMatrix& distances,
+      const Labels& labels,
+      exec::Policy policy = exec::Policy::threads
+    );
+    data_t silhouette(
+      const Dataset& data,
+      const Labels& labels,
+      dist::DistanceMeasure dist = dist::euclidean,
+      exec::Policy policy = exec::Policy::threads
+    );
+    data_t silhouette(
+      const DistanceMatrix& distances,
+      const Labels& labels,
+      exec::Policy policy = exec::Policy::threads
+    );
+
+    // Mean silhouette width of a random sample of observations, each still
+    // measured against the whole dataset.
+    data_t sampledSilhouette(
+      const Dataset& data,
+      const Labels& labels,
+      index_t sampleSize,
+      unsigned int seed = 0,
+      dist::DistanceMeasure dist = dist::euclidean,
+      exec::Policy policy = exec::Policy::threads
+    );
+
+    data_t calinskiHarabasz(
+      const Dataset& data,
+      const Labels& labels,
+      exec::Policy policy = exec::Policy::threads
+    );
+    data_t daviesBouldin(
+      const Dataset& data,
+      const Labels& labels,
+      dist::DistanceMeasure dist = dist::euclidean,
+      exec::Policy policy = exec::Policy::threads
+    );
+
+    data_t copheneticCorrelation(
+      const agg::Dendrogram& tree,
+      const DistanceMatrix& distances
+    );
+  }
 };
 
 template <unsigned int n>
-bool cluster::agg::nClusters(std::vector<cluster::Dataset> clusters) {
+bool cluster::agg::nClusters(const std::vector<cluster::Dataset>& clusters) {
   return clusters.size() == n;
 }
 